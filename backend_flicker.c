@@ -16,3 +16,13 @@ enum WhatToDo update_backend(void *state) {
 }
 
 void cleanup_backend(void *state) { free(state); }
+
+int backend_event_fd(void *state) {
+    (void)state;
+    return -1;
+}
+
+void backend_note_presentation(void *state, const struct present_info *p) {
+    (void)state;
+    (void)p;
+}
@@ -1,23 +1,196 @@
 #include "opencv2/opencv.hpp"
 
+#include "capture_thread.h"
 #include "interface.h"
+#include "mjpeg.h"
+#include "roi.h"
+#include "v4l_controls.h"
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
+
+#include <linux/videodev2.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <utility>
 
 // in [0,1], i.e, what brightness level is the light/dark cutoff
 #define THRESHOLD 0.3
+// How long the display flickers while searching for the region of interest
+#define ROI_SEARCH_TIME 2.0
+// A frame that grab() returns faster than this was already queued: taking a
+// ready buffer costs microseconds, waiting for one up to a frame interval
+#define BACKLOG_GRAB_NS 100000
+// Frames grabbed but not yet analysed; the grab thread waits if all are full
+#define FRAME_QUEUE 8
+// How long capture_frame waits for a grabbed frame, on a capture thread
+// (which must notice when it is stopped) and on the frontend's thread
+#define THREAD_FRAME_WAIT std::chrono::milliseconds(100)
+#define FRONTEND_FRAME_WAIT std::chrono::milliseconds(1)
+
+// How the luma of a retrieved frame is laid out
+enum Layout {
+    LayoutBGR,   // converted by OpenCV, the fallback
+    LayoutLuma,  // a plane of 8-bit luma first: GREY, NV12, YUV 4:2:0
+    LayoutYUYV,  // packed 4:2:2, luma in the first of two channels
+    LayoutUYVY,  // packed 4:2:2, luma in the second of two channels
+    LayoutMJPEG, // one row of compressed bytes
+};
+
+struct grabbed_frame {
+    cv::Mat data;
+    struct timespec capture_time;
+    bool backlog; // was already queued when grabbed
+};
 
 struct state {
     // Readout
     cv::VideoCapture *cap;
-    cv::Mat graylevel;
-    cv::Mat bgrframe;
+    enum Layout layout;
+    int width, height;
+    cv::Mat graylevel; // of BGR frames
+    struct mjpeg_decoder mjpeg;
+
+    // The grab thread timestamps and retrieves every frame, and queues it
+    // here, so that the next grab overlaps the analysis of this one
+    std::thread grabber;
+    std::mutex lock;
+    std::condition_variable frame_ready, slot_free;
+    struct grabbed_frame queue[FRAME_QUEUE];
+    int head, count;
+    bool stop_grabbing, grab_failed;
+    std::chrono::milliseconds frame_wait;
+    cv::Mat frame; // being analysed
+
+    int64_t nframes;
+
+    // Only this part of the frame is averaged, if roi_active
+    bool roi_active;
+    cv::Rect roi;
+    bool roi_searching;
+    int roi_search_frames;
+    struct roi_finder roi_finder;
+
+    // Camera controls are set through a second handle on the device
+    int control_fd;
+    struct v4l_controls controls;
 
     enum WhatToDo output_state;
     struct analysis control;
+
+    // If set, frames are captured and analysed on this thread
+    struct capture_thread *thread;
 };
 
+static enum Layout layout_for(uint32_t fourcc) {
+    switch (fourcc) {
+    case V4L2_PIX_FMT_GREY:
+    case V4L2_PIX_FMT_NV12:
+    case V4L2_PIX_FMT_NV21:
+    case V4L2_PIX_FMT_YUV420:
+    case V4L2_PIX_FMT_YVU420:
+        return LayoutLuma;
+    case V4L2_PIX_FMT_YUYV:
+    case V4L2_PIX_FMT_YVYU:
+        return LayoutYUYV;
+    case V4L2_PIX_FMT_UYVY:
+    case V4L2_PIX_FMT_VYUY:
+        return LayoutUYVY;
+    case V4L2_PIX_FMT_MJPEG:
+    case V4L2_PIX_FMT_JPEG:
+        return LayoutMJPEG;
+    default:
+        return LayoutBGR;
+    }
+}
+
+/* Whether a retrieved frame is laid out as s->layout expects */
+static bool frame_has_layout(const struct state *s, const cv::Mat &m) {
+    switch (s->layout) {
+    case LayoutLuma:
+        return m.type() == CV_8UC1 && m.cols == s->width &&
+               m.rows >= s->height;
+    case LayoutYUYV:
+    case LayoutUYVY:
+        return m.type() == CV_8UC2 && m.cols == s->width &&
+               m.rows == s->height;
+    case LayoutMJPEG:
+        return m.type() == CV_8UC1 && m.isContinuous() && m.total() > 0;
+    default:
+        return m.type() == CV_8UC3 && m.cols == s->width &&
+               m.rows == s->height;
+    }
+}
+
+/* Read frames in the camera's own pixel format if possible, so that no
+ * colour conversion pass is needed. OpenCV does not document the layout
+ * of unconverted frames, so one frame is checked first. */
+static void choose_layout(struct state *s) {
+    uint32_t fourcc = (uint32_t)s->cap->get(cv::CAP_PROP_FOURCC);
+    s->layout = layout_for(fourcc);
+    if (s->layout != LayoutBGR &&
+        !s->cap->set(cv::CAP_PROP_CONVERT_RGB, 0.)) {
+        s->layout = LayoutBGR;
+    }
+    if (s->layout != LayoutBGR) {
+        cv::Mat probe;
+        if (!s->cap->read(probe) || !frame_has_layout(s, probe)) {
+            s->cap->set(cv::CAP_PROP_CONVERT_RGB, 1.);
+            s->layout = LayoutBGR;
+        }
+    }
+    fprintf(stderr, "Pixel format %.4s, %s\n", (const char *)&fourcc,
+            s->layout == LayoutBGR ? "converted to BGR" : "read natively");
+}
+
+/* Grab frames as soon as the camera has them, and queue them for
+ * capture_frame; the capture time is taken when grab() returns */
+static void grab_loop(struct state *s) {
+    cv::Mat raw;
+    while (true) {
+        struct timespec grab_start, capture_time;
+        clock_gettime(CLOCK_MONOTONIC, &grab_start);
+        bool ok = s->cap->grab();
+        clock_gettime(CLOCK_MONOTONIC, &capture_time);
+        ok = ok && s->cap->retrieve(raw);
+
+        std::unique_lock<std::mutex> guard(s->lock);
+        s->slot_free.wait(guard, [s] {
+            return s->stop_grabbing || s->count < FRAME_QUEUE;
+        });
+        if (s->stop_grabbing) {
+            return;
+        }
+        if (!ok) {
+            s->grab_failed = true;
+            guard.unlock();
+            s->frame_ready.notify_one();
+            return;
+        }
+        // capture_frame only takes slots that have been counted
+        struct grabbed_frame *f =
+            &s->queue[(s->head + s->count) % FRAME_QUEUE];
+        guard.unlock();
+        // retrieve() may return a view of a buffer that the next grab
+        // reuses
+        raw.copyTo(f->data);
+        f->capture_time = capture_time;
+        f->backlog =
+            get_delta_nsec(grab_start, capture_time) < BACKLOG_GRAB_NS;
+        guard.lock();
+        s->count++;
+        guard.unlock();
+        s->frame_ready.notify_one();
+    }
+}
+
 static void *isetup(int camera) {
     struct state *s = new struct state;
     s->cap = new cv::VideoCapture(camera, cv::CAP_V4L);
@@ -38,16 +211,24 @@ static void *isetup(int camera) {
     fprintf(stderr, "Can set? Width %c Height %c Fps %c\n", w1 ? 'Y' : 'n',
             w2 ? 'Y' : 'n', w3 ? 'Y' : 'n');
 
-    // We disable all automatic correction effects. While these may be helpful
-    // getting a decent picture, alternating black-and-white images will only
-    // confuse the predictor
-    bool w4 = s->cap->set(cv::CAP_PROP_AUTO_EXPOSURE, 0.);
-    bool w5 = s->cap->set(cv::CAP_PROP_AUTO_WB, 0.);
-    fprintf(stderr, "Can set? Auto exposure %c Auto whitebalance %c\n",
-            w4 ? 'Y' : 'n', w5 ? 'Y' : 'n');
-    fprintf(stderr,
-            "Be sure to check `v4l2-ctl -d %d -l` and disable auto gain\n",
-            camera);
+    char *bufstr = getenv("LATENCYTOOL_BUFFERS");
+    if (bufstr) {
+        char *end;
+        long n = strtol(bufstr, &end, 10);
+        if (end == bufstr || *end || n < 1) {
+            // The queue depth sweep restarts the stream, which OpenCV hides
+            fprintf(stderr,
+                    "Invalid LATENCYTOOL_BUFFERS '%s', must be a buffer "
+                    "count with the OpenCV backend\n",
+                    bufstr);
+            delete s->cap;
+            delete s;
+            return NULL;
+        }
+        bool w6 = s->cap->set(cv::CAP_PROP_BUFFERSIZE, (double)n);
+        fprintf(stderr, "Can set? Buffer count %c (now %.0f)\n",
+                w6 ? 'Y' : 'n', s->cap->get(cv::CAP_PROP_BUFFERSIZE));
+    }
 
     double fps = s->cap->get(cv::CAP_PROP_FPS);
     double width = s->cap->get(cv::CAP_PROP_FRAME_WIDTH);
@@ -58,45 +239,299 @@ static void *isetup(int camera) {
         stderr,
         "nominal fps=%.0f width=%.0f height=%.0f autoexp=%.0f autowb=%.0f\n",
         fps, width, height, autoexp, autowb);
+    s->width = (int)width;
+    s->height = (int)height;
+    choose_layout(s);
 
-    if (setup_analysis(&s->control) < 0) {
+    s->roi_active = false;
+    s->roi_searching = false;
+    memset(&s->roi_finder, 0, sizeof(s->roi_finder));
+    char *roistr = getenv("LATENCYTOOL_ROI");
+    if (roistr) {
+        struct roi r;
+        if (parse_roi(roistr, &s->roi_searching, &r) < 0) {
+            delete s->cap;
+            delete s;
+            return NULL;
+        }
+        if (s->roi_searching) {
+            // Motion-JPEG frames are searched at the scale of their blocks
+            int scale = s->layout == LayoutMJPEG ? 8 : 1;
+            if (setup_roi_finder(&s->roi_finder, (s->width + scale - 1) / scale,
+                                 (s->height + scale - 1) / scale,
+                                 ROI_BLOCK / scale) < 0) {
+                delete s->cap;
+                delete s;
+                return NULL;
+            }
+            s->roi_search_frames = (int)(ROI_SEARCH_TIME * fps);
+        } else {
+            s->roi = cv::Rect(r.x0, r.y0, r.x1 - r.x0, r.y1 - r.y0) &
+                     cv::Rect(0, 0, (int)width, (int)height);
+            if (s->roi.empty()) {
+                fprintf(stderr, "Region of interest is outside the frame\n");
+                delete s->cap;
+                delete s;
+                return NULL;
+            }
+            s->roi_active = true;
+        }
+    }
+
+    struct capture_info info = {camera, fps, THRESHOLD};
+    if (setup_analysis(&s->control, &info) < 0) {
+        cleanup_roi_finder(&s->roi_finder);
+        delete s->cap;
+        delete s;
+        return NULL;
+    }
+    if (s->roi_searching) {
+        analysis_set_flicker(&s->control, FLICKER_ROI, true);
+    }
+
+    // We disable all automatic correction effects. While these may be helpful
+    // getting a decent picture, alternating black-and-white images will only
+    // confuse the predictor
+    char devname[50];
+    sprintf(devname, "/dev/video%d", camera);
+    double threshold =
+        s->control.auto_threshold
+            ? 0.
+            : (s->control.fixed_threshold > 0. ? s->control.fixed_threshold
+                                               : THRESHOLD);
+    int queued = (int)s->cap->get(cv::CAP_PROP_BUFFERSIZE);
+    if (queued < 1) {
+        queued = 4; // OpenCV's usual V4L buffer count
+    }
+    // OpenCV camera indices need not be V4L devices; without one, only
+    // what OpenCV itself offers can be turned off
+    memset(&s->controls, 0, sizeof(s->controls));
+    s->control_fd = open(devname, O_RDWR | O_CLOEXEC);
+    if (s->control_fd < 0) {
+        fprintf(stderr, "Failed to open %s for its controls: %s\n", devname,
+                strerror(errno));
+        bool w4 = s->cap->set(cv::CAP_PROP_AUTO_EXPOSURE, 0.);
+        bool w5 = s->cap->set(cv::CAP_PROP_AUTO_WB, 0.);
+        fprintf(stderr, "Can set? Auto exposure %c Auto whitebalance %c\n",
+                w4 ? 'Y' : 'n', w5 ? 'Y' : 'n');
+        fprintf(stderr, "Be sure to disable auto gain\n");
+    } else if (setup_v4l_controls(&s->controls, s->control_fd, fps, queued,
+                                  threshold) < 0) {
+        // An explicit LATENCYTOOL_EXPOSURE could not be applied
+        cleanup_v4l_controls(&s->controls);
+        close(s->control_fd);
+        cleanup_analysis(&s->control);
+        cleanup_roi_finder(&s->roi_finder);
         delete s->cap;
         delete s;
         return NULL;
     }
+    if (s->controls.searching) {
+        analysis_set_flicker(&s->control, FLICKER_EXPOSURE, true);
+    }
+    memset(&s->mjpeg, 0, sizeof(s->mjpeg));
+    if (s->layout == LayoutMJPEG && setup_mjpeg_decoder(&s->mjpeg) < 0) {
+        if (s->control_fd >= 0) {
+            cleanup_v4l_controls(&s->controls);
+            close(s->control_fd);
+        }
+        cleanup_analysis(&s->control);
+        cleanup_roi_finder(&s->roi_finder);
+        delete s->cap;
+        delete s;
+        return NULL;
+    }
+    s->nframes = 0;
     s->output_state = DisplayLight;
+    s->thread = NULL;
+
+    s->head = 0;
+    s->count = 0;
+    s->stop_grabbing = false;
+    s->grab_failed = false;
+    s->frame_wait = FRONTEND_FRAME_WAIT;
+    s->grabber = std::thread(grab_loop, s);
     return s;
 }
 
-extern "C" {
+static void update_roi_search(struct state *s, double level) {
+    const cv::Mat &m = s->frame;
+    switch (s->layout) {
+    case LayoutLuma:
+        roi_finder_add(&s->roi_finder, m.data, (int)m.step, 1, level);
+        break;
+    case LayoutYUYV:
+        roi_finder_add(&s->roi_finder, m.data, (int)m.step, 2, level);
+        break;
+    case LayoutUYVY:
+        roi_finder_add(&s->roi_finder, m.data + 1, (int)m.step, 2, level);
+        break;
+    case LayoutMJPEG:
+        roi_finder_add(&s->roi_finder, s->mjpeg.dc, s->mjpeg.bw, 1, level);
+        break;
+    default:
+        // Without a region, the whole frame was converted
+        roi_finder_add(&s->roi_finder, s->graylevel.data,
+                       (int)s->graylevel.step, 1, level);
+        break;
+    }
+    if (s->roi_finder.nframes < s->roi_search_frames) {
+        return;
+    }
+    s->roi_searching = false;
+    struct roi r;
+    if (roi_finder_result(&s->roi_finder, &r)) {
+        if (s->layout == LayoutMJPEG) {
+            r.x0 *= 8;
+            r.y0 *= 8;
+            r.x1 = r.x1 * 8 < s->width ? r.x1 * 8 : s->width;
+            r.y1 = r.y1 * 8 < s->height ? r.y1 * 8 : s->height;
+        }
+        fprintf(stderr, "Region of interest: x=%d-%d y=%d-%d\n", r.x0, r.x1,
+                r.y0, r.y1);
+        s->roi = cv::Rect(r.x0, r.y0, r.x1 - r.x0, r.y1 - r.y0);
+        s->roi_active = true;
+    } else {
+        fprintf(stderr, "No region follows the display; using whole frame\n");
+    }
+    cleanup_roi_finder(&s->roi_finder);
+    analysis_set_flicker(&s->control, FLICKER_ROI, false);
+}
 
-void *setup_backend(int camera) { return isetup(camera); }
+/* Mean luma of the frame within r, in [0,1]; -1 if it cannot be read */
+static double frame_level(struct state *s, const cv::Rect &r) {
+    const cv::Mat &m = s->frame;
+    switch (s->layout) {
+    case LayoutLuma:
+    case LayoutYUYV:
+        return cv::mean(m(r))[0] / 255.0;
+    case LayoutUYVY:
+        return cv::mean(m(r))[1] / 255.0;
+    case LayoutMJPEG: {
+        int max_row = r.y + r.height;
+        if (mjpeg_decode_dc(&s->mjpeg, m.data, m.total(), max_row) < 0 ||
+            s->mjpeg.width != s->width || s->mjpeg.height != s->height) {
+            return -1.;
+        }
+        cv::Mat dc(s->mjpeg.bh, s->mjpeg.bw, CV_8UC1, s->mjpeg.dc);
+        cv::Rect blocks(r.x / 8, r.y / 8, (r.x + r.width + 7) / 8 - r.x / 8,
+                        (r.y + r.height + 7) / 8 - r.y / 8);
+        return cv::mean(dc(blocks))[0] / 255.0;
+    }
+    default:
+        // Only convert the pixels that are used
+        cv::cvtColor(m(r), s->graylevel, cv::COLOR_BGR2GRAY);
+        return cv::mean(s->graylevel)[0] / 255.0;
+    }
+}
 
-enum WhatToDo update_backend(void *state) {
+/* Analyse the oldest grabbed frame, waiting briefly for one if needed */
+static enum WhatToDo capture_frame(void *state) {
     struct state *s = (struct state *)state;
-    // We return the opposite of the current camera state, and record/print
-    // brightness transitions
-    bool success = s->cap->read(s->bgrframe);
-    if (!success) {
-        return s->output_state;
+    struct timespec capture_time;
+    bool backlog;
+    {
+        std::unique_lock<std::mutex> guard(s->lock);
+        if (!s->frame_ready.wait_for(guard, s->frame_wait, [s] {
+                return s->count > 0 || s->grab_failed;
+            })) {
+            return s->output_state;
+        }
+        if (s->count == 0) {
+            fprintf(stderr, "Camera stopped delivering frames\n");
+            return Quit;
+        }
+        // The slot gets the previous frame's memory, for the next copy
+        struct grabbed_frame *f = &s->queue[s->head];
+        std::swap(s->frame, f->data);
+        capture_time = f->capture_time;
+        // Frames queued behind this one waited for the analysis
+        backlog = f->backlog || s->count > 1;
+        s->head = (s->head + 1) % FRAME_QUEUE;
+        s->count--;
     }
+    s->slot_free.notify_one();
 
-    // Record frame capture time *before* postprocessing, as though it
-    // had zero cost.
-    struct timespec capture_time;
-    clock_gettime(CLOCK_MONOTONIC, &capture_time);
+    if (!frame_has_layout(s, s->frame)) {
+        fprintf(stderr, "Skipping frame with unexpected size %dx%d\n",
+                s->frame.cols, s->frame.rows);
+        return s->output_state;
+    }
+    if (backlog) {
+        analysis_note_backlog(&s->control);
+    }
+    // Frames dropped by the camera are detected from the time gap
+    capture_time =
+        analysis_smooth_time(&s->control, s->nframes++, capture_time);
 
-    cv::cvtColor(s->bgrframe, s->graylevel, cv::COLOR_BGR2GRAY);
-    double level = cv::mean(s->graylevel)[0] / 255.0;
+    cv::Rect full(0, 0, s->width, s->height);
+    double level = frame_level(s, s->roi_active ? s->roi : full);
+    if (level < 0.) {
+        fprintf(stderr, "Skipping undecodable Motion-JPEG frame\n");
+        return s->output_state;
+    }
+    if (s->roi_searching) {
+        update_roi_search(s, level);
+    } else if (exposure_search_add(&s->controls, level)) {
+        analysis_set_flicker(&s->control, FLICKER_EXPOSURE, false);
+    }
 
     s->output_state =
         update_analysis(&s->control, capture_time, level, THRESHOLD);
     return s->output_state;
 }
 
+extern "C" {
+
+void *setup_backend(int camera) {
+    struct state *s = (struct state *)isetup(camera);
+    if (s && capture_thread_requested()) {
+        // capture_frame waits on the grab thread
+        s->frame_wait = THREAD_FRAME_WAIT;
+        s->thread =
+            start_capture_thread(-1, capture_frame, s, s->output_state);
+        if (!s->thread) {
+            cleanup_backend(s);
+            return NULL;
+        }
+    }
+    return s;
+}
+
+enum WhatToDo update_backend(void *state) {
+    struct state *s = (struct state *)state;
+    if (s->thread) {
+        return capture_thread_state(s->thread);
+    }
+    return capture_frame(s);
+}
+
+int backend_event_fd(void *state) {
+    struct state *s = (struct state *)state;
+    return s->thread ? capture_thread_event_fd(s->thread) : -1;
+}
+
+void backend_note_presentation(void *state, const struct present_info *p) {
+    struct state *s = (struct state *)state;
+    analysis_note_presentation(&s->control, p);
+}
+
 void cleanup_backend(void *state) {
     if (state) {
         struct state *s = (struct state *)state;
+        stop_capture_thread(s->thread);
+        {
+            std::lock_guard<std::mutex> guard(s->lock);
+            s->stop_grabbing = true;
+        }
+        s->slot_free.notify_one();
+        s->grabber.join();
+        cleanup_roi_finder(&s->roi_finder);
+        cleanup_mjpeg_decoder(&s->mjpeg);
+        if (s->control_fd >= 0) {
+            cleanup_v4l_controls(&s->controls);
+            close(s->control_fd);
+        }
         cleanup_analysis(&s->control);
 
         delete s->cap;
@@ -1,4 +1,9 @@
+#include "capture_thread.h"
 #include "interface.h"
+#include "mjpeg.h"
+#include "reduce.h"
+#include "roi.h"
+#include "v4l_controls.h"
 
 #include <stdbool.h>
 #include <stdint.h>
@@ -7,8 +12,10 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <math.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/poll.h>
@@ -17,56 +24,502 @@
 
 #include <linux/videodev2.h>
 
-// Parameters for PS3 Eye
-#define CAMERA_WIDTH 320
-#define CAMERA_HEIGHT 240
-#define CAMERA_PIXELFORMAT V4L2_PIX_FMT_SGBRG8
 #define CAMERA_FIELD V4L2_FIELD_NONE
-#define CAMERA_TIMEPERFRAME_NUM 1000
-#define CAMERA_TIMEPERFRAME_DENOM 187000
 #define THRESHOLD 0.3
 
-#define NUM_BUFS 5
+// Buffers queued to the driver, unless LATENCYTOOL_BUFFERS says otherwise
+#define DEFAULT_BUFS 5
+#define MAX_BUFS 32
+// LATENCYTOOL_BUFFERS=sweep measures each queue depth in this range, for
+// SWEEP_TIME seconds each
+#define SWEEP_MIN_BUFS 2
+#define SWEEP_MAX_BUFS 8
+#define SWEEP_TIME 5.0
+// USERPTR buffers share one arena on pages of this size
+#define HUGEPAGE_SIZE ((size_t)2 << 20)
+#define PAGE_ALIGN ((size_t)4096)
+// How long the display flickers while searching for the region of interest
+#define ROI_SEARCH_TIME 2.0
+// The camera given to setup_backend, and those in LATENCYTOOL_CAMERAS
+#define MAX_CAMERAS 8
 
 struct buf {
     void *data;
     size_t len;
 };
 
-struct state {
+// How capture buffers are allocated; see LATENCYTOOL_MEMORY
+enum BufferMemory {
+    MemoryMmap,    // by the driver, mapped here
+    MemoryUserptr, // here, in a hugepage arena
+};
+
+/* Luma reducers, one per pixel layout. Each sums the luma samples of row
+ * `y` over pixels [x0,x1), reading only the bytes that hold them, and
+ * counts the samples; the row loop is instantiated per layout so that the
+ * row function is inlined. */
+
+static inline uint64_t row_grey(const uint8_t *row, int y, int x0, int x1,
+                                int *n) {
+    (void)y; // only Bayer layouts alternate by row
+    *n = x1 - x0;
+    return reduce_sum(row + x0, x1 - x0);
+}
+
+// Packed 4:2:2 with luma first: Y0 U Y1 V
+static inline uint64_t row_yuyv(const uint8_t *row, int y, int x0, int x1,
+                                int *n) {
+    (void)y; // only Bayer layouts alternate by row
+    *n = x1 - x0;
+    return reduce_sum_even(row + 2 * x0, 2 * (x1 - x0));
+}
+
+// Packed 4:2:2 with chroma first: U Y0 V Y1
+static inline uint64_t row_uyvy(const uint8_t *row, int y, int x0, int x1,
+                                int *n) {
+    (void)y; // only Bayer layouts alternate by row
+    *n = x1 - x0;
+    return reduce_sum_even(row + 2 * x0 + 1, 2 * (x1 - x0) - 1);
+}
+
+// Bayer with green where x + y is even (GRBG, GBRG) or odd (RGGB, BGGR)
+static inline uint64_t row_bayer(const uint8_t *row, int y, int x0, int x1,
+                                 int parity, int *n) {
+    int first = x0 + ((x0 + y + parity) & 1);
+    if (first >= x1) {
+        *n = 0;
+        return 0;
+    }
+    *n = (x1 - first + 1) / 2;
+    return reduce_sum_even(row + first, x1 - first);
+}
+
+static inline uint64_t row_bayer_g0(const uint8_t *row, int y, int x0,
+                                    int x1, int *n) {
+    return row_bayer(row, y, x0, x1, 0, n);
+}
+
+static inline uint64_t row_bayer_g1(const uint8_t *row, int y, int x0,
+                                    int x1, int *n) {
+    return row_bayer(row, y, x0, x1, 1, n);
+}
+
+#define DEFINE_FRAME_LEVEL(layout)                                             \
+    static double frame_level_##layout(const uint8_t *data, int stride,       \
+                                       const struct roi *r) {                 \
+        uint64_t total = 0, samples = 0;                                       \
+        for (int y = r->y0; y < r->y1; y++) {                                  \
+            int n;                                                             \
+            total += row_##layout(data + (size_t)y * stride, y, r->x0, r->x1, \
+                                  &n);                                         \
+            samples += n;                                                      \
+        }                                                                      \
+        return samples ? total / (double)samples / 255.0 : 0.;                 \
+    }
+
+DEFINE_FRAME_LEVEL(grey)
+DEFINE_FRAME_LEVEL(yuyv)
+DEFINE_FRAME_LEVEL(uyvy)
+DEFINE_FRAME_LEVEL(bayer_g0)
+DEFINE_FRAME_LEVEL(bayer_g1)
+
+struct pixel_format {
+    uint32_t fourcc;
+    // NULL for Motion-JPEG, which is reduced from its decoded block means
+    double (*level)(const uint8_t *data, int stride, const struct roi *r);
+    int luma_offset; // of the first pixel's luma byte
+    int pixel_step;  // bytes between pixels
+};
+
+// In order of preference, when modes are otherwise equal
+static const struct pixel_format pixel_formats[] = {
+    {V4L2_PIX_FMT_GREY, frame_level_grey, 0, 1},
+    // Planar formats start with the full resolution luma plane
+    {V4L2_PIX_FMT_NV12, frame_level_grey, 0, 1},
+    {V4L2_PIX_FMT_NV21, frame_level_grey, 0, 1},
+    {V4L2_PIX_FMT_YUV420, frame_level_grey, 0, 1},
+    {V4L2_PIX_FMT_YVU420, frame_level_grey, 0, 1},
+    {V4L2_PIX_FMT_SGRBG8, frame_level_bayer_g0, 0, 1},
+    {V4L2_PIX_FMT_SGBRG8, frame_level_bayer_g0, 0, 1},
+    {V4L2_PIX_FMT_SRGGB8, frame_level_bayer_g1, 0, 1},
+    {V4L2_PIX_FMT_SBGGR8, frame_level_bayer_g1, 0, 1},
+    {V4L2_PIX_FMT_YUYV, frame_level_yuyv, 0, 2},
+    {V4L2_PIX_FMT_YVYU, frame_level_yuyv, 0, 2},
+    {V4L2_PIX_FMT_UYVY, frame_level_uyvy, 1, 2},
+    {V4L2_PIX_FMT_VYUY, frame_level_uyvy, 1, 2},
+    {V4L2_PIX_FMT_MJPEG, NULL, 0, 1},
+    {V4L2_PIX_FMT_JPEG, NULL, 0, 1},
+};
+#define NUM_PIXEL_FORMATS                                                      \
+    (int)(sizeof(pixel_formats) / sizeof(pixel_formats[0]))
+
+struct mode {
+    int format; // index into pixel_formats
+    uint32_t width, height;
+    struct v4l2_fract interval; // seconds per frame
+    bool rate_known; // if not, interval is a placeholder ranking last
+};
+
+struct state;
+
+struct camera {
+    struct state *backend;
+    int number; // N of /dev/videoN
     int fd;
-    struct buf bufs[NUM_BUFS];
+    enum BufferMemory memory;
+    int nbufs;
+    struct buf bufs[MAX_BUFS];
+    size_t sizeimage; // bytes per frame, at most
+    // Backing for USERPTR buffers
+    uint8_t *arena;
+    size_t arena_size, buffer_stride;
+    bool arena_hugetlb;
+    int timestamp_source; // LOG_TIMESTAMP_*
+    bool have_sequence;
+    uint32_t last_sequence;
+    int64_t sequence; // without 32-bit wraparound
+    const struct pixel_format *format;
+    int width, height, stride;
+    struct roi full; // the whole frame
+
+    // Only this part of the frame is reduced, if roi_active
+    bool roi_active;
+    struct roi roi;
+    bool roi_searching;
+    int roi_search_frames;
+    struct roi_finder roi_finder;
+
+    struct mjpeg_decoder mjpeg;
+    uint64_t undecodable; // Motion-JPEG frames skipped
+
+    // Manual exposure, and the search for the shortest usable one
+    struct v4l_controls controls;
+
+    // Queue depth sweep: the capture path at each depth, from device
+    // timestamps; the backend quits once it is done
+    bool sweeping, sweep_done;
+    int sweep_depth;  // requested; the driver may allocate more
+    int sweep_frames; // per depth
+    int sweep_count;
+    uint64_t sweep_dropped, sweep_backlog;
+    struct delay_stats sweep_delay;
+
+    // FLICKER_ROI and FLICKER_EXPOSURE, while this camera needs them
+    unsigned flicker;
 
     enum WhatToDo output_state;
     struct analysis control;
 };
 
-static int ioctl_loop(int fd, unsigned long int req, void *arg) {
-    // In case frontend has weird signal settings, check for EINTR
-    while (1) {
-        int r = ioctl(fd, req, arg);
-        if (r == -1 && errno == EINTR) {
+/* The first camera's analysis drives the display. The others are passive,
+ * and measure the delays of the switches it makes; the display flickers
+ * while any camera needs it to. */
+struct state {
+    struct camera *cameras[MAX_CAMERAS];
+    int ncameras;
+    int epoll_fd; // readable when any camera has a frame, if ncameras > 1
+
+    // If set, frames are captured and analysed on this thread
+    struct capture_thread *thread;
+};
+
+/* Driver timestamps are only comparable to our own if they use the same
+ * clock; they are taken at the start of exposure or the end of readout. */
+static int timestamp_source(uint32_t flags) {
+    if ((flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) !=
+        V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC) {
+        return LOG_TIMESTAMP_HOST;
+    }
+    if ((flags & V4L2_BUF_FLAG_TSTAMP_SRC_MASK) ==
+        V4L2_BUF_FLAG_TSTAMP_SRC_SOE) {
+        return LOG_TIMESTAMP_START_OF_EXPOSURE;
+    }
+    return LOG_TIMESTAMP_END_OF_FRAME;
+}
+
+static int find_pixel_format(uint32_t fourcc) {
+    for (int i = 0; i < NUM_PIXEL_FORMATS; i++) {
+        if (pixel_formats[i].fourcc == fourcc) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Prefer the highest frame rate, then the fewest pixels */
+static bool better_mode(const struct mode *a, const struct mode *b) {
+    uint64_t rate_a = (uint64_t)a->interval.denominator * b->interval.numerator;
+    uint64_t rate_b = (uint64_t)b->interval.denominator * a->interval.numerator;
+    if (rate_a != rate_b) {
+        return rate_a > rate_b;
+    }
+    uint64_t area_a = (uint64_t)a->width * a->height;
+    uint64_t area_b = (uint64_t)b->width * b->height;
+    if (area_a != area_b) {
+        return area_a < area_b;
+    }
+    return a->format < b->format;
+}
+
+static void consider_mode(const struct mode *m, struct mode *best,
+                          bool *found) {
+    if (m->interval.numerator == 0 || m->interval.denominator == 0) {
+        return;
+    }
+    if (!*found || better_mode(m, best)) {
+        *best = *m;
+        *found = true;
+    }
+}
+
+static void enum_intervals(int fd, struct mode *m, struct mode *best,
+                           bool *found) {
+    struct v4l2_frmivalenum ival;
+    memset(&ival, 0, sizeof(ival));
+    ival.pixel_format = pixel_formats[m->format].fourcc;
+    ival.width = m->width;
+    ival.height = m->height;
+    for (ival.index = 0; ioctl_loop(fd, VIDIOC_ENUM_FRAMEINTERVALS, &ival) == 0;
+         ival.index++) {
+        m->rate_known = true;
+        if (ival.type == V4L2_FRMIVAL_TYPE_DISCRETE) {
+            m->interval = ival.discrete;
+            consider_mode(m, best, found);
+        } else {
+            // Continuous or stepwise ranges are listed once
+            m->interval = ival.stepwise.min;
+            consider_mode(m, best, found);
+            break;
+        }
+    }
+    if (ival.index == 0) {
+        // Rate unknown; keep the mode in case nothing else is listed, and
+        // leave the camera at its own rate
+        m->rate_known = false;
+        m->interval.numerator = 1;
+        m->interval.denominator = 1;
+        consider_mode(m, best, found);
+    }
+}
+
+/* Enumerate every supported format, frame size, and frame interval */
+static int choose_mode(int fd, struct mode *best) {
+    bool found = false;
+    struct v4l2_fmtdesc desc;
+    memset(&desc, 0, sizeof(desc));
+    desc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    for (desc.index = 0; ioctl_loop(fd, VIDIOC_ENUM_FMT, &desc) == 0;
+         desc.index++) {
+        struct mode m;
+        memset(&m, 0, sizeof(m));
+        m.format = find_pixel_format(desc.pixelformat);
+        if (m.format < 0) {
             continue;
         }
-        return r;
+        struct v4l2_frmsizeenum size;
+        memset(&size, 0, sizeof(size));
+        size.pixel_format = desc.pixelformat;
+        for (size.index = 0;
+             ioctl_loop(fd, VIDIOC_ENUM_FRAMESIZES, &size) == 0;
+             size.index++) {
+            if (size.type == V4L2_FRMSIZE_TYPE_DISCRETE) {
+                m.width = size.discrete.width;
+                m.height = size.discrete.height;
+                enum_intervals(fd, &m, best, &found);
+            } else {
+                m.width = size.stepwise.min_width;
+                m.height = size.stepwise.min_height;
+                enum_intervals(fd, &m, best, &found);
+                break;
+            }
+        }
     }
+    return found ? 0 : -1;
 }
 
-void *setup_backend(int camera) {
-    struct state *s = calloc(1, sizeof(struct state));
+static uint32_t v4l2_memory(const struct camera *c) {
+    return c->memory == MemoryUserptr ? V4L2_MEMORY_USERPTR
+                                      : V4L2_MEMORY_MMAP;
+}
+
+static void unmap_buffers(struct camera *c) {
+    for (int i = 0; i < MAX_BUFS; i++) {
+        if (c->bufs[i].len && c->memory != MemoryUserptr) {
+            munmap(c->bufs[i].data, c->bufs[i].len);
+        }
+        c->bufs[i].len = 0;
+    }
+    if (c->arena) {
+        if (c->arena_hugetlb) {
+            munmap(c->arena, c->arena_size);
+        } else {
+            free(c->arena);
+        }
+        c->arena = NULL;
+    }
+    c->nbufs = 0;
+}
+
+/* One allocation for all USERPTR buffers, each page aligned, on 2 MiB
+ * pages: reserved hugetlbfs pages if there are any, and otherwise
+ * transparent huge pages if the kernel will give them. */
+static int setup_arena(struct camera *c) {
+    c->buffer_stride = (c->sizeimage + PAGE_ALIGN - 1) & ~(PAGE_ALIGN - 1);
+    size_t size = c->buffer_stride * c->nbufs;
+    c->arena_size = (size + HUGEPAGE_SIZE - 1) & ~(HUGEPAGE_SIZE - 1);
+
+    void *arena = mmap(NULL, c->arena_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    c->arena_hugetlb = arena != MAP_FAILED;
+    if (!c->arena_hugetlb) {
+        if (posix_memalign(&arena, HUGEPAGE_SIZE, c->arena_size) != 0) {
+            fprintf(stderr, "Failed to allocate capture buffers\n");
+            return -1;
+        }
+        if (madvise(arena, c->arena_size, MADV_HUGEPAGE) < 0) {
+            fprintf(stderr, "Transparent huge pages unavailable: %s\n",
+                    strerror(errno));
+        }
+    }
+    // Fault every page in now, rather than on the first frames
+    memset(arena, 0, c->arena_size);
+    c->arena = arena;
+    fprintf(stderr, "Capture buffers: %zu KiB on %s pages\n",
+            c->arena_size >> 10,
+            c->arena_hugetlb ? "hugetlb" : "transparent huge");
+    return 0;
+}
+
+/* Map the driver's buffer `i` for reading */
+static int map_buffer(struct camera *c, int i, const struct v4l2_buffer *buf) {
+    if (buf->length == 0) {
+        fprintf(stderr, "Zero buffer length\n");
+        return -1;
+    }
+    void *data = mmap(NULL, buf->length, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      c->fd, buf->m.offset);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Failed to map buffer\n");
+        return -1;
+    }
+    c->bufs[i].data = data;
+    c->bufs[i].len = buf->length;
+    return 0;
+}
+
+/* Allocate, map, and queue `count` buffers; the driver may allocate more */
+static int setup_buffers(struct camera *c, int count) {
+    struct v4l2_requestbuffers reqbufs;
+    memset(&reqbufs, 0, sizeof(reqbufs));
+    reqbufs.count = count;
+    reqbufs.memory = v4l2_memory(c);
+    reqbufs.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    if (ioctl_loop(c->fd, VIDIOC_REQBUFS, &reqbufs) < 0) {
+        fprintf(stderr, "Failed to request buffers: %s\n", strerror(errno));
+        return -1;
+    }
+    if (reqbufs.count < 1 || reqbufs.count > MAX_BUFS) {
+        fprintf(stderr, "Driver allocated %u buffers, can use 1 to %d\n",
+                reqbufs.count, MAX_BUFS);
+        return -1;
+    }
+    c->nbufs = reqbufs.count;
+    fprintf(stderr, "Capture queue: %d buffers\n", c->nbufs);
+    if (c->memory == MemoryUserptr && setup_arena(c) < 0) {
+        goto fail;
+    }
+
+    for (int i = 0; i < c->nbufs; i++) {
+        struct v4l2_buffer buf;
+        memset(&buf, 0, sizeof(buf));
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = reqbufs.memory;
+        buf.index = i;
+
+        if (ioctl_loop(c->fd, VIDIOC_QUERYBUF, &buf) < 0) {
+            fprintf(stderr, "Failed to query buffers info %d/%d: %s\n", i,
+                    c->nbufs, strerror(errno));
+            goto fail;
+        }
+        if (i == 0) {
+            c->timestamp_source = timestamp_source(buf.flags);
+        }
+
+        if (c->memory == MemoryUserptr) {
+            c->bufs[i].data = c->arena + i * c->buffer_stride;
+            c->bufs[i].len = c->sizeimage;
+            buf.m.userptr = (unsigned long)c->bufs[i].data;
+            buf.length = c->sizeimage;
+        } else if (map_buffer(c, i, &buf) < 0) {
+            goto fail;
+        }
+
+        if (ioctl_loop(c->fd, VIDIOC_QBUF, &buf) < 0) {
+            fprintf(stderr, "Failed to queue buffer: %s\n", strerror(errno));
+            goto fail;
+        }
+    }
+    return 0;
+fail:
+    unmap_buffers(c);
+    return -1;
+}
+
+/* Stop streaming, and start again with a new number of buffers */
+static int restart_stream(struct camera *c, int count) {
+    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (ioctl_loop(c->fd, VIDIOC_STREAMOFF, &type) < 0) {
+        fprintf(stderr, "Failed to stop stream: %s\n", strerror(errno));
+        return -1;
+    }
+    unmap_buffers(c);
+    // Buffers must be freed before a different number can be allocated
+    struct v4l2_requestbuffers reqbufs;
+    memset(&reqbufs, 0, sizeof(reqbufs));
+    reqbufs.count = 0;
+    reqbufs.memory = v4l2_memory(c);
+    reqbufs.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (ioctl_loop(c->fd, VIDIOC_REQBUFS, &reqbufs) < 0) {
+        fprintf(stderr, "Failed to free buffers: %s\n", strerror(errno));
+        return -1;
+    }
+    if (setup_buffers(c, count) < 0) {
+        return -1;
+    }
+    if (ioctl_loop(c->fd, VIDIOC_STREAMON, &type) < 0) {
+        fprintf(stderr, "Failed to start stream: %s\n", strerror(errno));
+        return -1;
+    }
+    // Frames lost during the restart are not the camera's
+    c->have_sequence = false;
+    return 0;
+}
+
+/* Open and start camera `number`; secondary cameras have passive
+ * analyses, and log to the primary's log path with a suffix */
+static struct camera *setup_camera(struct state *s, int number,
+                                   bool primary, bool multiple) {
+    struct camera *c = calloc(1, sizeof(struct camera));
+    if (!c) {
+        fprintf(stderr, "Failed to allocate camera %d\n", number);
+        return NULL;
+    }
+    c->backend = s;
+    c->number = number;
 
     char devname[50];
-    sprintf(devname, "/dev/video%d", camera);
+    sprintf(devname, "/dev/video%d", number);
 
-    s->fd = open(devname, O_RDWR | O_NONBLOCK, 0);
-    if (s->fd == -1) {
+    c->fd = open(devname, O_RDWR | O_NONBLOCK, 0);
+    if (c->fd == -1) {
         fprintf(stderr, "Failed to open fd at %s: %s\n", devname,
                 strerror(errno));
         goto fail_free;
     }
 
     struct v4l2_capability cap;
-    if (ioctl_loop(s->fd, VIDIOC_QUERYCAP, &cap) < 0) {
+    if (ioctl_loop(c->fd, VIDIOC_QUERYCAP, &cap) < 0) {
         fprintf(stderr, "Not a video device: %s\n", strerror(errno));
         goto fail_vfd;
     }
@@ -77,182 +530,610 @@ void *setup_backend(int camera) {
         goto fail_vfd;
     }
 
-    struct v4l2_streamparm sparm;
-    memset(&sparm, 0, sizeof(sparm));
-    sparm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    sparm.parm.capture.timeperframe.numerator = CAMERA_TIMEPERFRAME_NUM;
-    sparm.parm.capture.timeperframe.denominator = CAMERA_TIMEPERFRAME_DENOM;
-    if (ioctl_loop(s->fd, VIDIOC_S_PARM, &sparm) < 0) {
-        fprintf(stderr, "Failed to set FPS: %s\n", strerror(errno));
+    struct mode mode;
+    if (choose_mode(c->fd, &mode) < 0) {
+        fprintf(stderr, "Camera offers no supported format\n");
         goto fail_vfd;
     }
-    if (ioctl_loop(s->fd, VIDIOC_G_PARM, &sparm) < 0) {
-        fprintf(stderr, "Failed to get FPS: %s\n", strerror(errno));
-        goto fail_vfd;
+    c->format = &pixel_formats[mode.format];
+    if (mode.rate_known) {
+        fprintf(stderr, "Chosen mode: %.4s %ux%u at %u/%u s per frame\n",
+                (const char *)&c->format->fourcc, mode.width, mode.height,
+                mode.interval.numerator, mode.interval.denominator);
+    } else {
+        fprintf(stderr, "Chosen mode: %.4s %ux%u at the camera's rate\n",
+                (const char *)&c->format->fourcc, mode.width, mode.height);
     }
-    fprintf(stderr, "Camera FPS is: %f\n",
-            sparm.parm.capture.timeperframe.denominator /
-                (double)sparm.parm.capture.timeperframe.numerator);
 
     struct v4l2_format fmt;
     memset(&fmt, 0, sizeof(fmt));
     fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    fmt.fmt.pix.width = CAMERA_WIDTH;
-    fmt.fmt.pix.height = CAMERA_HEIGHT;
-    fmt.fmt.pix.pixelformat = CAMERA_PIXELFORMAT;
+    fmt.fmt.pix.width = mode.width;
+    fmt.fmt.pix.height = mode.height;
+    fmt.fmt.pix.pixelformat = c->format->fourcc;
     fmt.fmt.pix.field = CAMERA_FIELD;
-    if (ioctl_loop(s->fd, VIDIOC_S_FMT, &fmt) < 0) {
+    if (ioctl_loop(c->fd, VIDIOC_S_FMT, &fmt) < 0) {
         fprintf(stderr, "Failed to set video format: %s\n", strerror(errno));
         goto fail_vfd;
     }
     fprintf(stderr,
             "width=%d/%d height=%d/%d pixelfmt=%x/%x field=%d/%d colorspace=%d "
             "xfer_func=%d\n",
-            fmt.fmt.pix.width, CAMERA_WIDTH, fmt.fmt.pix.height, CAMERA_HEIGHT,
-            fmt.fmt.pix.pixelformat, CAMERA_PIXELFORMAT, fmt.fmt.pix.field,
+            fmt.fmt.pix.width, mode.width, fmt.fmt.pix.height, mode.height,
+            fmt.fmt.pix.pixelformat, c->format->fourcc, fmt.fmt.pix.field,
             CAMERA_FIELD, fmt.fmt.pix.colorspace, fmt.fmt.pix.xfer_func);
 
-    if (fmt.fmt.pix.width != CAMERA_WIDTH ||
-        fmt.fmt.pix.height != CAMERA_HEIGHT ||
+    if (fmt.fmt.pix.width != mode.width ||
+        fmt.fmt.pix.height != mode.height ||
+        fmt.fmt.pix.pixelformat != c->format->fourcc ||
         fmt.fmt.pix.field != CAMERA_FIELD) {
-        fprintf(stderr, "Video does not accept the hard-coded dimensions: %s\n",
-                strerror(errno));
+        fprintf(stderr, "Video does not accept the chosen mode\n");
+        goto fail_vfd;
+    }
+    c->width = fmt.fmt.pix.width;
+    c->height = fmt.fmt.pix.height;
+    if (!c->format->level && setup_mjpeg_decoder(&c->mjpeg) < 0) {
         goto fail_vfd;
     }
+    c->sizeimage = fmt.fmt.pix.sizeimage;
+    c->stride = fmt.fmt.pix.bytesperline
+                    ? (int)fmt.fmt.pix.bytesperline
+                    : c->width * c->format->pixel_step;
+    c->full.x0 = 0;
+    c->full.y0 = 0;
+    c->full.x1 = c->width;
+    c->full.y1 = c->height;
 
-    struct v4l2_requestbuffers reqbufs;
-    memset(&reqbufs, 0, sizeof(reqbufs));
-    reqbufs.count = NUM_BUFS;
-    reqbufs.memory = V4L2_MEMORY_MMAP;
-    reqbufs.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    // The frame rate must be set after the format, which may reset it
+    struct v4l2_streamparm sparm;
+    memset(&sparm, 0, sizeof(sparm));
+    sparm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    sparm.parm.capture.timeperframe = mode.interval;
+    if (mode.rate_known && ioctl_loop(c->fd, VIDIOC_S_PARM, &sparm) < 0) {
+        fprintf(stderr, "Failed to set FPS: %s\n", strerror(errno));
+        goto fail_vfd;
+    }
+    if (ioctl_loop(c->fd, VIDIOC_G_PARM, &sparm) < 0) {
+        fprintf(stderr, "Failed to get FPS: %s\n", strerror(errno));
+        goto fail_vfd;
+    }
+    if (!sparm.parm.capture.timeperframe.numerator) {
+        fprintf(stderr, "Camera does not report its frame rate\n");
+        goto fail_vfd;
+    }
+    double fps = sparm.parm.capture.timeperframe.denominator /
+                 (double)sparm.parm.capture.timeperframe.numerator;
+    fprintf(stderr, "Camera FPS is: %f\n", fps);
 
-    if (ioctl_loop(s->fd, VIDIOC_REQBUFS, &reqbufs) < 0) {
-        fprintf(stderr, "Failed to request buffers: %s\n", strerror(errno));
+    int nbufs = DEFAULT_BUFS;
+    char *bufstr = getenv("LATENCYTOOL_BUFFERS");
+    if (bufstr && !strcmp(bufstr, "sweep")) {
+        c->sweeping = true;
+        c->sweep_depth = SWEEP_MIN_BUFS;
+        nbufs = SWEEP_MIN_BUFS;
+    } else if (bufstr) {
+        char *end;
+        long n = strtol(bufstr, &end, 10);
+        if (end == bufstr || *end || n < 1 || n > MAX_BUFS) {
+            fprintf(stderr,
+                    "Invalid LATENCYTOOL_BUFFERS '%s', must be 1 to %d or "
+                    "'sweep'\n",
+                    bufstr, MAX_BUFS);
+            goto fail_vfd;
+        }
+        nbufs = (int)n;
+    }
+
+    char *memstr = getenv("LATENCYTOOL_MEMORY");
+    if (!memstr || !strcmp(memstr, "mmap")) {
+        c->memory = MemoryMmap;
+    } else if (!strcmp(memstr, "userptr")) {
+        c->memory = MemoryUserptr;
+    } else {
+        fprintf(stderr,
+                "Invalid LATENCYTOOL_MEMORY '%s', must be 'mmap' or "
+                "'userptr'\n",
+                memstr);
+        goto fail_vfd;
+    }
+    if (c->memory == MemoryUserptr && c->sizeimage == 0) {
+        fprintf(stderr, "Driver gave no frame size for user buffers\n");
+        goto fail_vfd;
+    }
+    if (setup_buffers(c, nbufs) < 0) {
         goto fail_vfd;
     }
 
-    for (int i = 0; i < NUM_BUFS; i++) {
-        struct v4l2_buffer buf;
-        memset(&buf, 0, sizeof(buf));
-        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buf.memory = V4L2_MEMORY_MMAP;
-        buf.index = i;
+    enum v4l2_buf_type buftype;
+    buftype = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (ioctl_loop(c->fd, VIDIOC_STREAMON, &buftype) < 0) {
+        fprintf(stderr, "Failed to start stream1: %s\n", strerror(errno));
+        goto fail_bufs;
+    }
 
-        if (ioctl_loop(s->fd, VIDIOC_QUERYBUF, &buf) < 0) {
-            fprintf(stderr, "Failed to query buffers info %d/%d: %s\n", i,
-                    NUM_BUFS, strerror(errno));
+    static const char *source_names[] = {"host", "start of exposure",
+                                         "end of frame"};
+    fprintf(stderr, "Capture timestamps: %s\n",
+            source_names[c->timestamp_source]);
+    if (c->sweeping) {
+        if (c->timestamp_source == LOG_TIMESTAMP_HOST) {
+            fprintf(stderr, "The queue depth sweep needs device timestamps\n");
             goto fail_bufs;
         }
-        if (buf.length == 0) {
-            fprintf(stderr, "Zero buffer length\n");
+        c->sweep_frames = fps > 1. ? (int)(SWEEP_TIME * fps) : 1;
+        if (setup_delay_stats(&c->sweep_delay, c->sweep_frames) < 0) {
             goto fail_bufs;
         }
+    }
 
-        s->bufs[i].len = buf.length;
-        s->bufs[i].data = mmap(NULL, buf.length, PROT_READ | PROT_WRITE,
-                               MAP_SHARED, s->fd, buf.m.offset);
-        if (s->bufs[i].data == MAP_FAILED) {
-            fprintf(stderr, "Failed to map buffer\n");
-            goto fail_bufs;
-        }
+    char *kernel = getenv("LATENCYTOOL_REDUCE");
+    if (kernel && reduce_select(kernel) < 0) {
+        goto fail_bufs;
+    }
+    fprintf(stderr, "Brightness reduction kernel: %s\n",
+            reduce_kernel()->name);
 
-        if (ioctl_loop(s->fd, VIDIOC_QBUF, &buf) < 0) {
-            fprintf(stderr, "Failed to queue buffer: %s\n", strerror(errno));
+    char *roistr = getenv("LATENCYTOOL_ROI");
+    if (roistr) {
+        if (parse_roi(roistr, &c->roi_searching, &c->roi) < 0) {
             goto fail_bufs;
         }
+        if (c->roi_searching) {
+            // Motion-JPEG frames are searched at the scale of their blocks
+            int scale = c->format->level ? 1 : 8;
+            if (setup_roi_finder(&c->roi_finder, (c->width + scale - 1) / scale,
+                                 (c->height + scale - 1) / scale,
+                                 ROI_BLOCK / scale) < 0) {
+                goto fail_bufs;
+            }
+            c->roi_search_frames = (int)(ROI_SEARCH_TIME * fps);
+        } else {
+            c->roi.x1 = c->roi.x1 < c->width ? c->roi.x1 : c->width;
+            c->roi.y1 = c->roi.y1 < c->height ? c->roi.y1 : c->height;
+            if (c->roi.x0 >= c->roi.x1 || c->roi.y0 >= c->roi.y1) {
+                fprintf(stderr, "Region of interest is outside the frame\n");
+                goto fail_bufs;
+            }
+            c->roi_active = true;
+        }
     }
 
-    enum v4l2_buf_type buftype;
-    buftype = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    if (ioctl_loop(s->fd, VIDIOC_STREAMON, &buftype) < 0) {
-        fprintf(stderr, "Failed to start stream1: %s\n", strerror(errno));
+    c->output_state = DisplayLight;
+    struct capture_info info = {number, fps, THRESHOLD, c->timestamp_source};
+    struct analysis_options opts;
+    if (read_analysis_options(&opts) < 0) {
         goto fail_bufs;
     }
-
-    s->output_state = DisplayLight;
-    if (setup_analysis(&s->control) < 0) {
+    char log_path[PATH_MAX], prefix[REPORT_PREFIX_LENGTH];
+    if (!primary) {
+        opts.passive = true;
+        if (opts.log_path) {
+            snprintf(log_path, sizeof(log_path), "%s.video%d", opts.log_path,
+                     number);
+            opts.log_path = log_path;
+        }
+    }
+    if (multiple) {
+        snprintf(prefix, sizeof(prefix), "video%d: ", number);
+        opts.prefix = prefix;
+    }
+    if (setup_analysis_opts(&c->control, &info, &opts) < 0) {
         goto fail_bufs;
     }
+    if (c->roi_searching) {
+        c->flicker |= FLICKER_ROI;
+    }
 
-    fprintf(stderr, "All set up\n");
-    return s;
-fail_bufs:
-    for (int i = 0; i < NUM_BUFS; i++) {
-        if (s->bufs[i].len) {
-            munmap(s->bufs[i].data, s->bufs[i].len);
-        }
+    double threshold =
+        c->control.auto_threshold
+            ? 0.
+            : (c->control.fixed_threshold > 0. ? c->control.fixed_threshold
+                                               : THRESHOLD);
+    if (setup_v4l_controls(&c->controls, c->fd, fps, c->nbufs, threshold) <
+        0) {
+        cleanup_analysis(&c->control);
+        goto fail_bufs;
+    }
+    if (c->controls.searching) {
+        c->flicker |= FLICKER_EXPOSURE;
     }
+    return c;
+fail_bufs:
+    cleanup_v4l_controls(&c->controls);
+    cleanup_roi_finder(&c->roi_finder);
+    cleanup_delay_stats(&c->sweep_delay);
+    unmap_buffers(c);
 fail_vfd:
-    close(s->fd);
+    cleanup_mjpeg_decoder(&c->mjpeg);
+    close(c->fd);
 fail_free:
-    free(s);
+    free(c);
     return NULL;
 }
 
-enum WhatToDo update_backend(void *state) {
-    struct state *s = (struct state *)state;
+/* Make the primary analysis flicker the display for `reason` while any
+ * camera needs it */
+static void update_flicker(struct state *s, unsigned reason) {
+    unsigned needed = 0;
+    for (int i = 0; i < s->ncameras; i++) {
+        needed |= s->cameras[i]->flicker;
+    }
+    struct analysis *a = &s->cameras[0]->control;
+    // Clearing a reason that is not set would recalibrate the threshold
+    if (!(a->flicker & reason) != !(needed & reason)) {
+        analysis_set_flicker(a, reason, needed & reason);
+    }
+}
 
-    struct pollfd pfd;
-    pfd.fd = s->fd;
-    pfd.events = POLLIN;
-    int p = poll(&pfd, 1, 1); // 1 msec max timeout
-    if (p < 0) {
-        fprintf(stderr, "Poll failed: %s\n", strerror(errno));
-        goto end;
-    } else if (p == 0) {
-        goto end;
+static void camera_set_flicker(struct camera *c, unsigned reason, bool on) {
+    c->flicker = on ? (c->flicker | reason) : (c->flicker & ~reason);
+    update_flicker(c->backend, reason);
+}
+
+/* Pass the primary analysis's display switches, and whether it is
+ * flickering the display, on to the other cameras */
+static void follow_primary(struct state *s, bool switched) {
+    const struct camera *p = s->cameras[0];
+    bool flickering = p->control.flicker != 0;
+    for (int i = 1; i < s->ncameras; i++) {
+        struct analysis *a = &s->cameras[i]->control;
+        if (!(a->flicker & FLICKER_EXTERNAL) != !flickering) {
+            analysis_set_flicker(a, FLICKER_EXTERNAL, flickering);
+        }
+        if (switched && p->output_state != Quit) {
+            analysis_external_switch(a, p->control.next_switch_time,
+                                     p->output_state == DisplayDark);
+        }
     }
+}
 
-    struct v4l2_buffer buf;
-    memset(&buf, 0, sizeof(buf));
-    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    buf.memory = V4L2_MEMORY_MMAP;
-    if (ioctl_loop(s->fd, VIDIOC_DQBUF, &buf) < 0) {
-        if (errno == EAGAIN) {
-            goto end;
-        } else {
-            fprintf(stderr, "Dequeue failed: %s\n", strerror(errno));
-            goto end;
+/* The level of a Motion-JPEG frame; -1 if it cannot be decoded. Only the
+ * blocks overlapping the region of interest are used. */
+static double mjpeg_level(struct camera *c, const uint8_t *data, size_t len) {
+    const struct roi *r = c->roi_active ? &c->roi : &c->full;
+    if (mjpeg_decode_dc(&c->mjpeg, data, len, r->y1) < 0 ||
+        c->mjpeg.width != c->width || c->mjpeg.height != c->height) {
+        return -1.;
+    }
+    struct roi blocks = {r->x0 / 8, r->y0 / 8, (r->x1 + 7) / 8,
+                         (r->y1 + 7) / 8};
+    return frame_level_grey(c->mjpeg.dc, c->mjpeg.bw, &blocks);
+}
+
+static void update_roi_search(struct camera *c, const uint8_t *data,
+                              double level) {
+    if (c->format->level) {
+        roi_finder_add(&c->roi_finder, data + c->format->luma_offset,
+                       c->stride, c->format->pixel_step, level);
+    } else {
+        roi_finder_add(&c->roi_finder, c->mjpeg.dc, c->mjpeg.bw, 1, level);
+    }
+    if (c->roi_finder.nframes < c->roi_search_frames) {
+        return;
+    }
+    c->roi_searching = false;
+    if (roi_finder_result(&c->roi_finder, &c->roi)) {
+        if (!c->format->level) {
+            c->roi.x0 *= 8;
+            c->roi.y0 *= 8;
+            c->roi.x1 = c->roi.x1 * 8 < c->width ? c->roi.x1 * 8 : c->width;
+            c->roi.y1 = c->roi.y1 * 8 < c->height ? c->roi.y1 * 8 : c->height;
         }
+        fprintf(stderr, "Region of interest: x=%d-%d y=%d-%d\n", c->roi.x0,
+                c->roi.x1, c->roi.y0, c->roi.y1);
+        c->roi_active = true;
+    } else {
+        fprintf(stderr, "No region follows the display; using whole frame\n");
     }
+    cleanup_roi_finder(&c->roi_finder);
+    camera_set_flicker(c, FLICKER_ROI, false);
+}
 
-    struct timespec captime;
-    clock_gettime(CLOCK_MONOTONIC, &captime);
+/* Analyse a dequeued frame, then give its buffer back to the driver */
+static void process_buffer(struct camera *c, struct v4l2_buffer *buf,
+                           struct timespec dqtime, bool backlog) {
+    // Sequence numbers skip the frames the driver had to drop
+    uint32_t step = c->have_sequence ? buf->sequence - c->last_sequence : 1;
+    c->have_sequence = true;
+    c->last_sequence = buf->sequence;
+    c->sequence += step;
 
-    int length = s->bufs[buf.index].len;
-    uint8_t *data = (uint8_t *)s->bufs[buf.index].data;
+    struct timespec captime = dqtime;
+    if (c->timestamp_source != LOG_TIMESTAMP_HOST) {
+        captime.tv_sec = buf->timestamp.tv_sec;
+        captime.tv_nsec = buf->timestamp.tv_usec * 1000;
+        int dropped = step > 0 && step < INT32_MAX ? (int)step - 1 : 0;
+        double queue_delay = get_delta_nsec(captime, dqtime) * 1e-6;
+        analysis_note_capture(&c->control, queue_delay, dropped);
+        if (c->sweeping) {
+            delay_stats_add(&c->sweep_delay, queue_delay, false);
+            c->sweep_dropped += dropped;
+            c->sweep_count++;
+        }
+    }
+    if (backlog) {
+        analysis_note_backlog(&c->control);
+        if (c->sweeping) {
+            c->sweep_backlog++;
+        }
+    }
+    captime = analysis_smooth_time(&c->control, c->sequence, captime);
 
-    // TODO: does interpreting the colors & Bayer layout make sense,
-    // or should the fact that we just feed light/dark inputs mean that
-    // we can safely average pixel values and get 'good-enough' results?
-    uint64_t net_val = 0;
-    for (int i = 0; i < length; i++) {
-        net_val += data[i];
+    uint8_t *data = (uint8_t *)c->bufs[buf->index].data;
+    double avg_val;
+    if (c->format->level) {
+        avg_val = c->format->level(data, c->stride,
+                                   c->roi_active ? &c->roi : &c->full);
+    } else {
+        avg_val = mjpeg_level(c, data, buf->bytesused);
+        if (avg_val < 0.) {
+            // Reported at doubling counts, so damaged streams do not
+            // flood stderr
+            c->undecodable++;
+            if ((c->undecodable & (c->undecodable - 1)) == 0) {
+                fprintf(stderr, "Skipped %lu undecodable Motion-JPEG "
+                                "frames\n",
+                        (unsigned long)c->undecodable);
+            }
+            if (ioctl_loop(c->fd, VIDIOC_QBUF, buf) < 0) {
+                fprintf(stderr, "Requeue failed: %s\n", strerror(errno));
+            }
+            return;
+        }
+    }
+    if (c->roi_searching) {
+        update_roi_search(c, data, avg_val);
+    } else if (exposure_search_add(&c->controls, avg_val)) {
+        // Searched after the region of interest, with its better contrast
+        camera_set_flicker(c, FLICKER_EXPOSURE, false);
     }
-    double avg_val = net_val / (double)(length) / 255.0;
 
-    if (ioctl_loop(s->fd, VIDIOC_QBUF, &buf) < 0) {
+    if (ioctl_loop(c->fd, VIDIOC_QBUF, buf) < 0) {
         fprintf(stderr, "Requeue failed: %s\n", strerror(errno));
     }
 
-    s->output_state = update_analysis(&s->control, captime, avg_val, THRESHOLD);
-end:
-    return s->output_state;
+    enum WhatToDo before = c->output_state;
+    c->output_state = update_analysis(&c->control, captime, avg_val, THRESHOLD);
+    if (c == c->backend->cameras[0]) {
+        follow_primary(c->backend, c->output_state != before);
+    }
 }
 
-void cleanup_backend(void *state) {
-    struct state *s = state;
+/* Report the capture path at the current queue depth, and move on to the
+ * next one */
+static void advance_sweep(struct camera *c) {
+    struct delay_report r;
+    delay_stats_report(&c->sweep_delay, &r);
+    fprintf(stderr,
+            "Queue depth %2d: queue delay p50/p95/p99 %5.2f/%5.2f/%5.2fms "
+            "max %5.2fms; dropped %lu of %lu frames; %lu waited behind newer "
+            "ones\n",
+            c->nbufs, r.net.p50, r.net.p95, r.net.p99, r.net.max,
+            (unsigned long)c->sweep_dropped,
+            (unsigned long)(c->sweep_count + c->sweep_dropped),
+            (unsigned long)c->sweep_backlog);
 
+    c->sweep_count = 0;
+    c->sweep_dropped = 0;
+    c->sweep_backlog = 0;
+    cleanup_delay_stats(&c->sweep_delay);
+    if (c->sweep_depth >= SWEEP_MAX_BUFS ||
+        setup_delay_stats(&c->sweep_delay, c->sweep_frames) < 0 ||
+        restart_stream(c, ++c->sweep_depth) < 0) {
+        c->sweeping = false;
+        c->sweep_done = true;
+    }
+}
+
+/* Dequeue every frame that is ready, and analyse them in order; all but
+ * the newest were already waiting when the backend got to them */
+static enum WhatToDo capture_camera(struct camera *c) {
+    struct v4l2_buffer ready[MAX_BUFS];
+    int nready = 0;
+    while (nready < c->nbufs) {
+        struct v4l2_buffer *buf = &ready[nready];
+        memset(buf, 0, sizeof(*buf));
+        buf->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf->memory = v4l2_memory(c);
+        if (ioctl_loop(c->fd, VIDIOC_DQBUF, buf) < 0) {
+            if (errno != EAGAIN) {
+                fprintf(stderr, "Dequeue failed: %s\n", strerror(errno));
+            }
+            break;
+        }
+        nready++;
+    }
+
+    struct timespec dqtime;
+    clock_gettime(CLOCK_MONOTONIC, &dqtime);
+    for (int i = 0; i < nready; i++) {
+        process_buffer(c, &ready[i], dqtime, i < nready - 1);
+    }
+
+    if (c->sweeping && c->sweep_count >= c->sweep_frames) {
+        advance_sweep(c);
+    }
+    return c->sweep_done ? Quit : c->output_state;
+}
+
+/* Handle every camera with frames ready. A secondary camera's analysis
+ * quitting, e.g. once its delays converge, does not end the measurement. */
+static enum WhatToDo capture_frame(void *state) {
+    struct state *s = (struct state *)state;
+    struct camera *primary = s->cameras[0];
+    if (s->ncameras == 1) {
+        return capture_camera(primary);
+    }
+
+    struct epoll_event events[MAX_CAMERAS];
+    int n = epoll_wait(s->epoll_fd, events, MAX_CAMERAS, 0);
+    if (n < 0 && errno != EINTR) {
+        fprintf(stderr, "Epoll failed: %s\n", strerror(errno));
+    }
+    for (int i = 0; i < n; i++) {
+        struct camera *c = events[i].data.ptr;
+        if (!(events[i].events & EPOLLIN)) {
+            fprintf(stderr, "Camera %d failed\n", c->number);
+            return Quit;
+        }
+        if (capture_camera(c) == Quit && (c == primary || c->sweep_done)) {
+            return Quit;
+        }
+    }
+    return primary->output_state;
+}
+
+static void cleanup_camera(struct camera *c) {
     enum v4l2_buf_type type;
     type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    ioctl_loop(s->fd, VIDIOC_STREAMOFF, &type);
-    for (int i = 0; i < NUM_BUFS; i++) {
-        if (s->bufs[i].len) {
-            munmap(s->bufs[i].data, s->bufs[i].len);
+    ioctl_loop(c->fd, VIDIOC_STREAMOFF, &type);
+    unmap_buffers(c);
+    cleanup_v4l_controls(&c->controls);
+    close(c->fd);
+    cleanup_roi_finder(&c->roi_finder);
+    cleanup_mjpeg_decoder(&c->mjpeg);
+    cleanup_delay_stats(&c->sweep_delay);
+    cleanup_analysis(&c->control);
+
+    free(c);
+}
+
+/* Parse LATENCYTOOL_CAMERAS, a comma separated list of further camera
+ * numbers */
+static int parse_cameras(const char *str, int first, int *numbers,
+                         int *count) {
+    numbers[0] = first;
+    *count = 1;
+    const char *p = str;
+    while (*p) {
+        char *end;
+        long n = strtol(p, &end, 10);
+        bool repeated = false;
+        for (int i = 0; i < *count; i++) {
+            repeated = repeated || numbers[i] == n;
+        }
+        if (end == p || (*end && *end != ',') || n < 0 || n > INT_MAX ||
+            repeated || *count >= MAX_CAMERAS) {
+            fprintf(stderr,
+                    "Invalid LATENCYTOOL_CAMERAS '%s', must list up to %d "
+                    "other camera numbers, separated by commas\n",
+                    str, MAX_CAMERAS - 1);
+            return -1;
+        }
+        numbers[(*count)++] = (int)n;
+        p = *end ? end + 1 : end;
+    }
+    return 0;
+}
+
+void *setup_backend(int camera) {
+    struct state *s = calloc(1, sizeof(struct state));
+    if (!s) {
+        fprintf(stderr, "Failed to allocate capture state\n");
+        return NULL;
+    }
+    s->epoll_fd = -1;
+
+    int numbers[MAX_CAMERAS], count = 1;
+    numbers[0] = camera;
+    char *camstr = getenv("LATENCYTOOL_CAMERAS");
+    if (camstr && parse_cameras(camstr, camera, numbers, &count) < 0) {
+        goto fail;
+    }
+    for (int i = 0; i < count; i++) {
+        if (count > 1) {
+            fprintf(stderr, "Setting up camera %d\n", numbers[i]);
+        }
+        struct camera *c = setup_camera(s, numbers[i], i == 0, count > 1);
+        if (!c) {
+            goto fail;
         }
+        s->cameras[s->ncameras++] = c;
     }
-    close(s->fd);
-    cleanup_analysis(&s->control);
+    update_flicker(s, FLICKER_ROI);
+    update_flicker(s, FLICKER_EXPOSURE);
+    follow_primary(s, false);
 
+    int wait_fd = s->cameras[0]->fd;
+    if (count > 1) {
+        // Level triggered: capture_camera leaves nothing ready behind
+        s->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (s->epoll_fd < 0) {
+            fprintf(stderr, "Failed to create epoll set: %s\n",
+                    strerror(errno));
+            goto fail;
+        }
+        for (int i = 0; i < s->ncameras; i++) {
+            struct epoll_event ev;
+            memset(&ev, 0, sizeof(ev));
+            ev.events = EPOLLIN;
+            ev.data.ptr = s->cameras[i];
+            if (epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->cameras[i]->fd,
+                          &ev) < 0) {
+                fprintf(stderr, "Failed to watch camera %d: %s\n",
+                        s->cameras[i]->number, strerror(errno));
+                goto fail;
+            }
+        }
+        wait_fd = s->epoll_fd;
+    }
+
+    if (capture_thread_requested()) {
+        s->thread = start_capture_thread(wait_fd, capture_frame, s,
+                                         s->cameras[0]->output_state);
+        if (!s->thread) {
+            goto fail;
+        }
+    }
+
+    fprintf(stderr, "All set up\n");
+    return s;
+fail:
+    cleanup_backend(s);
+    return NULL;
+}
+
+enum WhatToDo update_backend(void *state) {
+    struct state *s = (struct state *)state;
+    if (s->thread) {
+        return capture_thread_state(s->thread);
+    }
+
+    struct pollfd pfd;
+    pfd.fd = s->ncameras > 1 ? s->epoll_fd : s->cameras[0]->fd;
+    pfd.events = POLLIN;
+    int p = poll(&pfd, 1, 1); // 1 msec max timeout
+    if (p < 0) {
+        fprintf(stderr, "Poll failed: %s\n", strerror(errno));
+        return s->cameras[0]->output_state;
+    } else if (p == 0) {
+        return s->cameras[0]->output_state;
+    }
+    return capture_frame(s);
+}
+
+int backend_event_fd(void *state) {
+    struct state *s = (struct state *)state;
+    return s->thread ? capture_thread_event_fd(s->thread) : -1;
+}
+
+void backend_note_presentation(void *state, const struct present_info *p) {
+    struct state *s = state;
+    // Every camera watches the same display
+    for (int i = 0; i < s->ncameras; i++) {
+        analysis_note_presentation(&s->cameras[i]->control, p);
+    }
+}
+
+void cleanup_backend(void *state) {
+    struct state *s = state;
+
+    stop_capture_thread(s->thread);
+    for (int i = 0; i < s->ncameras; i++) {
+        cleanup_camera(s->cameras[i]);
+    }
+    if (s->epoll_fd >= 0) {
+        close(s->epoll_fd);
+    }
     free(s);
 }
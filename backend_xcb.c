@@ -94,3 +94,13 @@ void cleanup_backend(void *state) {
     xcb_disconnect(s->conn);
     free(s);
 }
+
+int backend_event_fd(void *state) {
+    (void)state;
+    return -1;
+}
+
+void backend_note_presentation(void *state, const struct present_info *p) {
+    (void)state;
+    (void)p;
+}
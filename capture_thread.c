@@ -0,0 +1,167 @@
+#include "capture_thread.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+// Below the kernel's threaded interrupt handlers (priority 50), so that the
+// camera's own interrupts still run first
+#define CAPTURE_PRIORITY 40
+
+struct capture_thread {
+    pthread_t thread;
+    int device_fd;
+    enum WhatToDo (*capture)(void *);
+    void *backend;
+
+    atomic_int state; // enum WhatToDo
+    int event_fd;     // readable after `state` changes
+    atomic_bool stopping;
+    int stop_fd; // wakes the thread from poll
+};
+
+bool capture_thread_requested(void) {
+    char *value = getenv("LATENCYTOOL_CAPTURE_THREAD");
+    return value && strcmp(value, "0") != 0;
+}
+
+static void set_realtime_priority(void) {
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = CAPTURE_PRIORITY;
+    int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (err) {
+        fprintf(stderr,
+                "Capture thread runs at normal priority; SCHED_FIFO: %s\n",
+                strerror(err));
+    } else {
+        fprintf(stderr, "Capture thread runs with SCHED_FIFO priority %d\n",
+                CAPTURE_PRIORITY);
+    }
+}
+
+static void publish(struct capture_thread *t, enum WhatToDo wtd) {
+    if (atomic_exchange_explicit(&t->state, wtd, memory_order_release) ==
+        (int)wtd) {
+        return;
+    }
+    uint64_t one = 1;
+    if (write(t->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        fprintf(stderr, "Failed to signal frontend: %s\n", strerror(errno));
+    }
+}
+
+static void *capture_loop(void *arg) {
+    struct capture_thread *t = arg;
+    set_realtime_priority();
+
+    struct pollfd fds[2];
+    fds[0].fd = t->device_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = t->stop_fd;
+    fds[1].events = POLLIN;
+    while (!atomic_load_explicit(&t->stopping, memory_order_acquire)) {
+        if (t->device_fd >= 0) {
+            fds[0].revents = 0;
+            fds[1].revents = 0;
+            if (poll(fds, 2, -1) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                fprintf(stderr, "Poll failed: %s\n", strerror(errno));
+                break;
+            }
+            if (fds[1].revents) {
+                break;
+            }
+            if (!(fds[0].revents & POLLIN)) {
+                // Without this, an unplugged camera would spin the thread
+                fprintf(stderr, "Capture device failed\n");
+                publish(t, Quit);
+                break;
+            }
+        }
+        enum WhatToDo wtd = t->capture(t->backend);
+        publish(t, wtd);
+        if (wtd == Quit) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+struct capture_thread *start_capture_thread(int device_fd,
+                                            enum WhatToDo (*capture)(void *),
+                                            void *backend,
+                                            enum WhatToDo initial) {
+    struct capture_thread *t = calloc(1, sizeof(struct capture_thread));
+    if (!t) {
+        return NULL;
+    }
+    t->device_fd = device_fd;
+    t->capture = capture;
+    t->backend = backend;
+    atomic_init(&t->state, initial);
+    atomic_init(&t->stopping, false);
+
+    // Starts readable, so that the frontend picks up the initial state
+    t->event_fd = eventfd(1, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (t->event_fd < 0) {
+        fprintf(stderr, "Failed to create eventfd: %s\n", strerror(errno));
+        goto fail_free;
+    }
+    t->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (t->stop_fd < 0) {
+        fprintf(stderr, "Failed to create eventfd: %s\n", strerror(errno));
+        goto fail_event;
+    }
+    if (pthread_create(&t->thread, NULL, capture_loop, t) != 0) {
+        fprintf(stderr, "Failed to start capture thread\n");
+        goto fail_stop;
+    }
+    return t;
+fail_stop:
+    close(t->stop_fd);
+fail_event:
+    close(t->event_fd);
+fail_free:
+    free(t);
+    return NULL;
+}
+
+void stop_capture_thread(struct capture_thread *t) {
+    if (!t) {
+        return;
+    }
+    atomic_store_explicit(&t->stopping, true, memory_order_release);
+    uint64_t one = 1;
+    if (write(t->stop_fd, &one, sizeof(one)) < 0) {
+        fprintf(stderr, "Failed to stop capture thread: %s\n",
+                strerror(errno));
+    }
+    pthread_join(t->thread, NULL);
+    close(t->stop_fd);
+    close(t->event_fd);
+    free(t);
+}
+
+int capture_thread_event_fd(const struct capture_thread *t) {
+    return t->event_fd;
+}
+
+enum WhatToDo capture_thread_state(struct capture_thread *t) {
+    // Clear first: a change published after this read re-arms the fd
+    uint64_t count;
+    if (read(t->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        fprintf(stderr, "Failed to read eventfd: %s\n", strerror(errno));
+    }
+    return (enum WhatToDo)atomic_load_explicit(&t->state,
+                                               memory_order_acquire);
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "interface.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Runs a camera backend's capture and analysis on its own thread, so that
+ * frames are handled as soon as they arrive instead of when the frontend
+ * next calls update_backend. The latest WhatToDo is published through an
+ * atomic, and an eventfd becomes readable whenever it changes. */
+
+struct capture_thread;
+
+/* Whether LATENCYTOOL_CAPTURE_THREAD asks for a capture thread */
+bool capture_thread_requested(void);
+
+/* Call `capture` for every frame until it returns Quit or the thread is
+ * stopped. If device_fd >= 0, the thread waits for it to become readable
+ * before each call; otherwise `capture` must block until a frame is ready.
+ * Returns NULL on failure. */
+struct capture_thread *start_capture_thread(int device_fd,
+                                            enum WhatToDo (*capture)(void *),
+                                            void *backend,
+                                            enum WhatToDo initial);
+void stop_capture_thread(struct capture_thread *t);
+
+int capture_thread_event_fd(const struct capture_thread *t);
+/* The latest state; also clears the eventfd */
+enum WhatToDo capture_thread_state(struct capture_thread *t);
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,145 +1,707 @@
 #include "interface.h"
+#include "reporter.h"
 
 #include <math.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 
-// Tradeoff between statistical convergence and minimum time
-#define FIR_LENGTH 100
+// Tradeoff between statistical convergence and minimum time; the
+// window length can be overridden with LATENCYTOOL_WINDOW
+#define DEFAULT_WINDOW 100
 /* Wait long enough for the brightness to stabilize. */
 #define HOLD_MIN_TIME 0.040
 #define HOLD_MAX_TIME 0.100
+/* While calibrating, the display alternates at a fixed rate; each color is
+ * held long enough for the camera to see a settled level. */
+#define FLICKER_HOLD_TIME 0.150
+// Minimum duration of threshold calibration, and the frames it looks at
+#define THRESHOLD_CALIBRATION_TIME 2.0
+#define THRESHOLD_WINDOW_TIME 4.0
+// Frames over which the capture queue delay is summarized
+#define QUEUE_DELAY_WINDOW 1000
+// Threshold changes smaller than this are not reported
+#define THRESHOLD_REPORT_STEP 0.02
+// Presentations waiting for the next frame; frames come far more often
+#define PRESENT_QUEUE 16
 
-static double mean(double m0, double m1) { return m0 > 0. ? m1 / m0 : -1.; }
+/* Single-producer, single-consumer ring of presentations, filled by the
+ * frontend thread and drained by whichever thread runs update_analysis */
+struct present_queue {
+    atomic_uint_fast64_t head, tail;
+    struct present_info entries[PRESENT_QUEUE];
+};
 
-static double stdev(double m0, double m1, double m2) {
-    return m0 > 2. ? sqrt((m2 - m1 * m1 / m0) / (m0 - 1.)) : -1.;
+static int64_t timespec_nsec(struct timespec t) {
+    return t.tv_sec * (int64_t)1000000000 + t.tv_nsec;
 }
 
-int setup_analysis(struct analysis *a) {
-    a->fir = calloc(FIR_LENGTH, sizeof(double));
-    if (!a->fir) {
-        fprintf(stderr, "Failed to allocate ring buffer\n");
+static const char *interp_names[] = {"none", "linear", "step", "sigmoid"};
+
+const char *interpolation_name(enum Interpolation interp) {
+    return interp_names[interp];
+}
+
+int parse_interpolation(const char *name, enum Interpolation *interp) {
+    for (int i = 0; i < NumInterpolations; i++) {
+        if (!strcmp(name, interp_names[i])) {
+            *interp = (enum Interpolation)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int read_positive(const char *name, double *value) {
+    char *str = getenv(name);
+    if (!str) {
+        return 0;
+    }
+    char *end;
+    *value = strtod(str, &end);
+    if (end == str || *end || !(*value > 0.)) {
+        fprintf(stderr, "Invalid %s '%s', must be a positive number\n", name,
+                str);
+        return -1;
+    }
+    return 0;
+}
+
+// The mode a frontend applied, see analysis_set_present_mode
+static const char *applied_present_mode = NULL;
+
+void analysis_set_present_mode(const char *mode) {
+    applied_present_mode = mode;
+}
+
+int read_analysis_options(struct analysis_options *o) {
+    memset(o, 0, sizeof(*o));
+    o->window = DEFAULT_WINDOW;
+    o->interp = InterpolateLinear;
+    o->log_path = getenv("LATENCYTOOL_LOG");
+    o->label = getenv("LATENCYTOOL_LABEL");
+    o->present_mode = applied_present_mode;
+
+    char *winstr = getenv("LATENCYTOOL_WINDOW");
+    if (winstr) {
+        o->window = atoi(winstr);
+        if (o->window < 1 || o->window > MAX_STATS_WINDOW) {
+            fprintf(stderr, "Invalid LATENCYTOOL_WINDOW '%s', must be in "
+                            "[1,%d]\n",
+                    winstr, MAX_STATS_WINDOW);
+            return -1;
+        }
+    }
+    char *interpstr = getenv("LATENCYTOOL_INTERP");
+    if (interpstr && parse_interpolation(interpstr, &o->interp) < 0) {
+        fprintf(stderr, "Invalid LATENCYTOOL_INTERP '%s'\n", interpstr);
         return -1;
     }
+    char *threshstr = getenv("LATENCYTOOL_THRESHOLD");
+    if (threshstr) {
+        char *end = threshstr;
+        if (!strcmp(threshstr, "auto")) {
+            o->auto_threshold = true;
+        } else {
+            o->threshold = strtod(threshstr, &end);
+        }
+        if (!o->auto_threshold &&
+            (end == threshstr || *end || o->threshold <= 0. ||
+             o->threshold >= 1.)) {
+            fprintf(stderr, "Invalid LATENCYTOOL_THRESHOLD '%s', must be "
+                            "'auto' or in (0,1)\n",
+                    threshstr);
+            return -1;
+        }
+    }
+    if (read_positive("LATENCYTOOL_CI_TARGET", &o->ci_target) < 0 ||
+        read_positive("LATENCYTOOL_MAX_TIME", &o->max_time) < 0 ||
+        read_positive("LATENCYTOOL_SMOOTH", &o->smooth) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+int setup_analysis(struct analysis *a, const struct capture_info *info) {
+    struct analysis_options opts;
+    if (read_analysis_options(&opts) < 0) {
+        return -1;
+    }
+    return setup_analysis_opts(a, info, &opts);
+}
+
+int setup_analysis_opts(struct analysis *a, const struct capture_info *info,
+                        const struct analysis_options *opts) {
+    if (opts->window < 1 || opts->window > MAX_STATS_WINDOW) {
+        fprintf(stderr, "Statistics window %d not in [1,%d]\n", opts->window,
+                MAX_STATS_WINDOW);
+        return -1;
+    }
+    if (setup_delay_stats(&a->stats, opts->window) < 0) {
+        return -1;
+    }
+    a->presents = calloc(1, sizeof(struct present_queue));
+    if (!a->presents) {
+        cleanup_delay_stats(&a->stats);
+        return -1;
+    }
+    atomic_init(&a->presents->head, 0);
+    atomic_init(&a->presents->tail, 0);
+    a->presenting = false;
+    a->presentations = 0;
+    a->switch_present_ms = -1.;
+    a->fit_present_ms = -1.;
+    a->ntransitions = 0;
+    a->nrecent = 0;
+    a->fit_pending = false;
+    a->interp = opts->interp;
+    a->passive = opts->passive;
+    a->pending_switch = 0;
+    memset(a->prefix, 0, sizeof(a->prefix));
+    if (opts->prefix) {
+        strncpy(a->prefix, opts->prefix, sizeof(a->prefix) - 1);
+    }
+    if (opts->present_mode) {
+        size_t used = strlen(a->prefix);
+        snprintf(a->prefix + used, sizeof(a->prefix) - used, "%s: ",
+                 opts->present_mode);
+    }
+    a->flicker = 0;
+    a->ci_target = opts->ci_target;
+    a->max_time = opts->max_time;
+    a->stopping = false;
+    a->converged = false;
     a->nframes = 0;
-    a->fir_head = 0;
-    char *logpath = getenv("LATENCYTOOL_LOG");
-    if (logpath) {
-        a->log = fopen(logpath, "w");
-    } else {
-        a->log = NULL;
+    a->dropped_frames = 0;
+    a->pending_dropped = 0;
+    a->backlog_frames = 0;
+    a->pending_backlog = false;
+    a->smoothing = opts->smooth > 0.;
+    if (a->smoothing) {
+        setup_timestamp_filter(&a->smoother, info->fps, opts->smooth);
+    }
+
+    a->fixed_threshold = opts->threshold;
+    a->auto_threshold = opts->auto_threshold;
+    double nominal = opts->threshold > 0. ? opts->threshold : info->threshold;
+    a->reported_threshold = nominal;
+    int threshold_window =
+        info->fps > 0. ? (int)(THRESHOLD_WINDOW_TIME * info->fps) : 1000;
+    if (setup_threshold_tracker(&a->tracker, threshold_window, nominal) < 0) {
+        free(a->presents);
+        cleanup_delay_stats(&a->stats);
+        return -1;
+    }
+    a->device_timestamps = info->timestamp_source != LOG_TIMESTAMP_HOST;
+    if (a->device_timestamps &&
+        setup_delay_stats(&a->queue_delay, QUEUE_DELAY_WINDOW) < 0) {
+        cleanup_threshold_tracker(&a->tracker);
+        free(a->presents);
+        cleanup_delay_stats(&a->stats);
+        return -1;
     }
 
     clock_gettime(CLOCK_MONOTONIC, &a->setup_time);
 
+    a->logging = false;
+    a->reporter = NULL;
+    if (!opts->quiet) {
+        struct log_header header;
+        memset(&header, 0, sizeof(header));
+        header.camera = info->camera;
+        header.threshold = nominal;
+        header.fps = info->fps;
+        header.setup_time_ns = timespec_nsec(a->setup_time);
+        header.timestamp_source = info->timestamp_source;
+        if (opts->label && opts->present_mode) {
+            snprintf(header.label, sizeof(header.label), "%s (%s)",
+                     opts->label, opts->present_mode);
+        } else if (opts->label || opts->present_mode) {
+            strncpy(header.label,
+                    opts->label ? opts->label : opts->present_mode,
+                    sizeof(header.label) - 1);
+        }
+        a->logging = opts->log_path != NULL;
+        a->reporter = setup_reporter(opts->log_path, &header, a->prefix);
+        if (!a->reporter) {
+            if (a->device_timestamps) {
+                cleanup_delay_stats(&a->queue_delay);
+            }
+            cleanup_threshold_tracker(&a->tracker);
+            free(a->presents);
+            cleanup_delay_stats(&a->stats);
+            return -1;
+        }
+    }
+
     a->want_switch = false;
     // State initialization is arbitrary
     a->current_camera_level = 1.0;
     a->showing_dark = false;
     a->capture_time.tv_sec = 0;
     a->capture_time.tv_nsec = 0;
+    a->next_switch_time = a->capture_time;
+    a->switch_time = a->capture_time;
+    a->switch_to_dark = false;
 
+    // Passive analyses do not control the display, so cannot calibrate
+    if (a->auto_threshold && !a->passive) {
+        analysis_set_flicker(a, FLICKER_THRESHOLD, true);
+    }
     return 0;
 }
+static void print_final_report(const struct analysis *a) {
+    struct delay_confidence c;
+    delay_stats_confidence(&a->stats, &c);
+    double elapsed = get_delta_nsec(a->setup_time, a->capture_time) * 1e-9;
+    fprintf(stdout, "%sFinal: %s after %.1fs and %d transitions\n",
+            a->prefix, a->converged ? "converged" : "stopped", elapsed,
+            a->ntransitions);
+    fprintf(stdout,
+            "%sFinal: 95%% CI Net: %5.2f±%4.2fms L->D: %5.2f±%4.2fms D->L: "
+            "%5.2f±%4.2fms\n",
+            a->prefix, c.net.mean, c.net.half_width, c.ltd.mean,
+            c.ltd.half_width, c.dtl.mean, c.dtl.half_width);
+    fflush(stdout);
+}
+
 void cleanup_analysis(struct analysis *a) {
-    free(a->fir);
-    if (a->log) {
-        fclose(a->log);
+    if (a->reporter) {
+        cleanup_reporter(a->reporter);
+        // Printed after all queued output
+        if (a->ci_target > 0. || a->max_time > 0.) {
+            print_final_report(a);
+        }
+        if (a->smoothing) {
+            fprintf(stderr,
+                    "Timestamp smoothing: %lu frames, %lu renumbered, %lu "
+                    "replaced by the fit\n",
+                    (unsigned long)a->smoother.nframes,
+                    (unsigned long)a->smoother.renumbered,
+                    (unsigned long)a->smoother.rejected);
+        }
+    }
+    if (a->device_timestamps) {
+        cleanup_delay_stats(&a->queue_delay);
+    }
+    if (a->presenting) {
+        cleanup_delay_stats(&a->present_delay);
+        cleanup_delay_stats(&a->scanout_delay);
     }
+    free(a->presents);
+    cleanup_threshold_tracker(&a->tracker);
+    cleanup_delay_stats(&a->stats);
 }
 
-static void update_fir(struct analysis *a, double delay, bool now_is_dark) {
-    int idx = a->nframes % FIR_LENGTH;
-    a->nframes++;
-    a->fir[idx] = (now_is_dark ? delay : -delay) * 1e3;
-
-    double n_ltd = 0., sum_ltd = 0., sum_ltd2 = 0.;
-    double n_dtl = 0., sum_dtl = 0., sum_dtl2 = 0.;
-    double min_tot = 1e100;
-    double max_tot = -1e100;
-    for (int i = 0; i < fmin(a->nframes - 2, FIR_LENGTH); i++) {
-        double idel = a->fir[(FIR_LENGTH + a->nframes - i - 1) % FIR_LENGTH];
-        if (idel > 0) {
-            n_ltd += 1.;
-            sum_ltd += idel;
-            sum_ltd2 += idel * idel;
-        } else {
-            n_dtl += 1.;
-            sum_dtl += -idel;
-            sum_dtl2 += idel * idel;
-        }
-        max_tot = fmax(max_tot, fabs(idel));
-        min_tot = fmin(min_tot, fabs(idel));
-    }
-    double n_tot = n_ltd + n_dtl, sum_tot = sum_ltd + sum_dtl,
-           sum_tot2 = sum_ltd2 + sum_dtl2;
-
-    double mean_ltd = mean(n_ltd, sum_ltd);
-    double mean_dtl = mean(n_dtl, sum_dtl);
-    double mean_tot = mean(n_tot, sum_tot);
-    double std_ltd = stdev(n_ltd, sum_ltd, sum_ltd2);
-    double std_dtl = stdev(n_dtl, sum_dtl, sum_dtl2);
-    double std_tot = stdev(n_tot, sum_tot, sum_tot2);
-    fprintf(stdout,
-            "Net: (%5.2f < %5.2f±%4.2f < %5.2f)ms L->D: (%5.2f±%4.2f)ms; "
-            "D->L: (%5.2f±%4.2f)ms\n",
-            min_tot, mean_tot, std_tot, max_tot, mean_ltd, std_ltd, mean_dtl,
-            std_dtl);
-    fflush(stdout);
+static void report_message(struct analysis *a, const char *fmt, ...) {
+    if (!a->reporter) {
+        return;
+    }
+    struct report_entry e;
+    e.kind = REPORT_MESSAGE;
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(e.message, sizeof(e.message), fmt, args);
+    va_end(args);
+    reporter_push(a->reporter, &e);
+}
+
+static void log_frame(struct analysis *a, struct timespec meas_time,
+                      double meas_level, double threshold,
+                      int display_transition, bool camera_transition) {
+    if (!a->logging) {
+        return;
+    }
+    struct report_entry e;
+    e.kind = REPORT_FRAME;
+    memset(&e.frame, 0, sizeof(e.frame));
+    e.frame.time_ns = get_delta_nsec(a->setup_time, meas_time);
+    if (display_transition) {
+        e.frame.switch_ns = get_delta_nsec(a->setup_time, a->next_switch_time);
+    }
+    e.frame.level = meas_level;
+    e.frame.threshold = threshold;
+    e.frame.display_transition = display_transition;
+    e.frame.flags = camera_transition ? LOG_FLAG_CAMERA_TRANSITION : 0;
+    if (a->pending_backlog) {
+        e.frame.flags |= LOG_FLAG_BACKLOG;
+    }
+    e.frame.dropped = a->pending_dropped > UINT16_MAX ? UINT16_MAX
+                                                      : a->pending_dropped;
+    reporter_push(a->reporter, &e);
+}
+
+void analysis_set_flicker(struct analysis *a, unsigned reason, bool on) {
+    unsigned was = a->flicker;
+    a->flicker = on ? (a->flicker | reason) : (a->flicker & ~reason);
+    if (!on && reason != FLICKER_THRESHOLD && a->auto_threshold &&
+        !a->passive) {
+        reset_threshold_tracker(&a->tracker);
+        a->flicker |= FLICKER_THRESHOLD;
+        a->flicker_frames = 0;
+    }
+    if (!was && a->flicker) {
+        a->flicker_frames = 0;
+        a->fit_pending = false;
+        a->want_switch = false;
+    } else if (was && !a->flicker && !a->passive) {
+        // Resume the closed loop with an immediate switch; the crossing
+        // after the last open-loop one may already have been seen
+        a->want_switch = true;
+        a->next_switch_time = a->capture_time;
+    }
+}
+
+/* Track the light/dark threshold, and end its calibration once it is
+ * trustworthy. Returns the threshold to use for this frame. */
+static double update_threshold(struct analysis *a, double meas_level,
+                               double threshold) {
+    if (a->fixed_threshold > 0.) {
+        threshold = a->fixed_threshold;
+    }
+    if (!a->auto_threshold) {
+        return threshold;
+    }
+    threshold = threshold_tracker_add(&a->tracker, meas_level);
+    if ((a->flicker & FLICKER_THRESHOLD) && a->tracker.confident &&
+        get_delta_nsec(a->flicker_start, a->capture_time) >=
+            THRESHOLD_CALIBRATION_TIME * 1e9) {
+        report_message(a, "Calibrated threshold: %.3f (separation %.2f)",
+                       threshold, a->tracker.separation);
+        a->reported_threshold = threshold;
+        analysis_set_flicker(a, FLICKER_THRESHOLD, false);
+    } else if (!(a->flicker & FLICKER_THRESHOLD) &&
+               fabs(threshold - a->reported_threshold) >=
+                   THRESHOLD_REPORT_STEP) {
+        report_message(a, "Threshold changed: %.3f (separation %.2f)",
+                       threshold, a->tracker.separation);
+        a->reported_threshold = threshold;
+    }
+    return threshold;
+}
+
+/* Remember a display switch, to match with its presentation */
+static void note_switch(struct analysis *a, int display_transition) {
+    if (!display_transition) {
+        return;
+    }
+    a->switch_time = a->next_switch_time;
+    a->switch_to_dark = display_transition > 0;
+    a->switch_present_ms = -1.;
+}
+
+/* Match queued presentations with the latest display switch; those of
+ * earlier switches are only counted */
+static void take_presentations(struct analysis *a) {
+    struct present_queue *q = a->presents;
+    uint64_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+    if (tail == head) {
+        return;
+    }
+    if (!a->presenting) {
+        int window = a->stats.window;
+        if (setup_delay_stats(&a->present_delay, window) < 0) {
+            return;
+        }
+        if (setup_delay_stats(&a->scanout_delay, window) < 0) {
+            cleanup_delay_stats(&a->present_delay);
+            return;
+        }
+        a->presenting = true;
+    }
+    for (; tail != head; tail++) {
+        const struct present_info *p = &q->entries[tail % PRESENT_QUEUE];
+        a->presentations++;
+        a->present_flags = p->flags;
+        a->refresh_ns = p->refresh_ns;
+        int64_t ns = get_delta_nsec(a->switch_time, p->time);
+        if (p->to_dark != a->switch_to_dark || a->switch_present_ms >= 0. ||
+            ns < 0) {
+            continue;
+        }
+        a->switch_present_ms = ns * 1e-6;
+        if (!a->flicker) {
+            delay_stats_add(&a->present_delay, a->switch_present_ms,
+                            p->to_dark);
+        }
+    }
+    atomic_store_explicit(&q->tail, tail, memory_order_release);
+}
+
+/* Alternate the display open-loop, without measuring delays; a passive
+ * analysis leaves that to whichever one drives the display */
+static void update_flicker(struct analysis *a, struct timespec meas_time,
+                           double meas_level, double threshold, bool crossed) {
+    int display_transition = a->pending_switch;
+    if (!a->passive &&
+        get_delta_nsec(a->next_switch_time, meas_time) >=
+            FLICKER_HOLD_TIME * 1e9) {
+        a->showing_dark = !a->showing_dark;
+        clock_gettime(CLOCK_MONOTONIC, &a->next_switch_time);
+        display_transition = a->showing_dark ? 1 : -1;
+    }
+    note_switch(a, display_transition);
+    log_frame(a, meas_time, meas_level, threshold, display_transition,
+              crossed);
+}
+
+/* Record a transition delay; `present_ms` is the part of it before the
+ * switch was scanned out, or negative if unknown */
+static void update_fir(struct analysis *a, double delay, bool now_is_dark,
+                       double present_ms) {
+    // The first transitions have no valid preceding switch time
+    a->ntransitions++;
+    if (a->ntransitions <= 2) {
+        return;
+    }
+    delay_stats_add(&a->stats, delay * 1e3, now_is_dark);
+    if (present_ms >= 0.) {
+        delay_stats_add(&a->scanout_delay, delay * 1e3 - present_ms,
+                        now_is_dark);
+    }
+
+    if (a->ci_target > 0.) {
+        struct delay_confidence c;
+        delay_stats_confidence(&a->stats, &c);
+        if (c.net.half_width <= a->ci_target &&
+            c.ltd.half_width <= a->ci_target &&
+            c.dtl.half_width <= a->ci_target) {
+            a->stopping = true;
+            a->converged = true;
+        }
+    }
+
+    if (!a->reporter) {
+        return;
+    }
+    // Printing is left to the reporter thread
+    struct report_entry e;
+    e.kind = REPORT_SUMMARY;
+    delay_stats_report(&a->stats, &e.summary);
+    reporter_push(a->reporter, &e);
+
+    if (a->device_timestamps || a->backlog_frames) {
+        struct delay_report queue;
+        delay_stats_report(&a->queue_delay, &queue);
+        e.kind = REPORT_CAPTURE;
+        e.capture.queue_delay = queue.net;
+        e.capture.frames = a->nframes;
+        e.capture.dropped = a->dropped_frames;
+        e.capture.backlog = a->backlog_frames;
+        reporter_push(a->reporter, &e);
+    }
+
+    if (a->presenting) {
+        struct delay_report present, scanout;
+        delay_stats_report(&a->present_delay, &present);
+        delay_stats_report(&a->scanout_delay, &scanout);
+        e.kind = REPORT_PRESENT;
+        e.present.to_scanout = present.net;
+        e.present.to_camera = scanout.net;
+        e.present.presentations = a->presentations;
+        e.present.refresh_ms = a->refresh_ns * 1e-6;
+        e.present.flags = a->present_flags;
+        reporter_push(a->reporter, &e);
+    }
+}
+
+/* Estimate the pending crossing time from the frames around it, ignoring
+ * the `skip` most recent frames, and record the delay. */
+static void finish_fit(struct analysis *a, int skip) {
+    const int ring = FIT_FRAMES + 1;
+    int n = FIT_PRE_FRAMES + a->fit_after;
+    if ((uint64_t)(n + skip) > a->nrecent) {
+        n = a->nrecent - skip;
+    }
+    int npre = n - a->fit_after;
+
+    double t[FIT_FRAMES] = {0.}, level[FIT_FRAMES] = {0.};
+    uint64_t first = a->nrecent - skip - n;
+    int64_t origin_ns = a->recent_ns[first % ring];
+    for (int i = 0; i < n; i++) {
+        t[i] = (a->recent_ns[(first + i) % ring] - origin_ns) * 1e-9;
+        level[i] = a->recent_level[(first + i) % ring];
+    }
+
+    int64_t crossing_ns = a->fit_linear_ns;
+    double t_cross;
+    if (fit_crossing(t, level, n, npre, a->fit_threshold,
+                     a->interp == InterpolateSigmoid, &t_cross)) {
+        crossing_ns = origin_ns + (int64_t)(t_cross * 1e9);
+    }
+    a->fit_pending = false;
+    update_fir(a, (crossing_ns - a->fit_switch_ns) * 1e-9, a->fit_to_dark,
+               a->fit_present_ms);
 }
 
 enum WhatToDo update_analysis(struct analysis *a, struct timespec meas_time,
                               double meas_level, double threshold) {
+    if (a->stopping) {
+        return Quit;
+    }
+    a->nframes++;
+    a->recent_ns[a->nrecent % (FIT_FRAMES + 1)] =
+        get_delta_nsec(a->setup_time, meas_time);
+    a->recent_level[a->nrecent % (FIT_FRAMES + 1)] = meas_level;
+    a->nrecent++;
+    take_presentations(a);
+
     struct timespec last_capture_time = a->capture_time;
     float last_camera_level = a->current_camera_level;
     a->current_camera_level = meas_level;
     a->capture_time = meas_time;
 
+    if (a->flicker && a->flicker_frames++ == 0) {
+        a->flicker_start = meas_time;
+    }
+    threshold = update_threshold(a, meas_level, threshold);
     bool was_dark = last_camera_level <= threshold;
     bool is_dark = a->current_camera_level <= threshold;
+    if (a->flicker) {
+        update_flicker(a, meas_time, meas_level, threshold,
+                       was_dark != is_dark);
+        goto end;
+    }
 
     struct timespec transition_time = last_capture_time;
     if (was_dark != is_dark) {
-        // With a reasonably fast camera, the screen color change
-        // curve can be reasonably well captured by linear interpolation.
-        double t = (threshold - last_camera_level) /
-                   (a->current_camera_level - last_camera_level);
-        int64_t nsec_gap = get_delta_nsec(last_capture_time, a->capture_time);
-        int64_t step = (int64_t)(t * nsec_gap);
-        transition_time = advance_time(last_capture_time, step);
+        if (a->fit_pending) {
+            finish_fit(a, 1);
+        }
+
+        if (a->interp != InterpolateNone) {
+            // With a reasonably fast camera, the screen color change
+            // curve can be reasonably well captured by linear interpolation.
+            double t = (threshold - last_camera_level) /
+                       (a->current_camera_level - last_camera_level);
+            int64_t nsec_gap =
+                get_delta_nsec(last_capture_time, a->capture_time);
+            int64_t step = (int64_t)(t * nsec_gap);
+            transition_time = advance_time(last_capture_time, step);
+        } else {
+            transition_time = a->capture_time;
+        }
 
         // Delay computed relative to old switch time
         double delay =
             get_delta_nsec(a->next_switch_time, transition_time) * 1e-9;
+        double present_ms =
+            is_dark == a->switch_to_dark ? a->switch_present_ms : -1.;
 
-        // Randomly pick the amount of time to wait after the transition,
-        // to avoid accidentally synchronizing with something.
-        double hold_time = HOLD_MIN_TIME + (HOLD_MAX_TIME - HOLD_MIN_TIME) *
-                                               (rand() / (double)RAND_MAX);
-        a->next_switch_time = advance_time(transition_time, hold_time * 1e9);
-        a->want_switch = true;
+        bool fit = a->interp == InterpolateStep ||
+                   a->interp == InterpolateSigmoid;
+        if (fit) {
+            // Wait for a few more frames before estimating the delay; the
+            // next switch is still scheduled from the linear estimate
+            a->fit_pending = true;
+            a->fit_to_dark = is_dark;
+            a->fit_after = 1;
+            a->fit_threshold = threshold;
+            a->fit_switch_ns = get_delta_nsec(a->setup_time, a->next_switch_time);
+            a->fit_linear_ns = get_delta_nsec(a->setup_time, transition_time);
+            a->fit_present_ms = present_ms;
+        }
+
+        if (!a->passive) {
+            // Randomly pick the amount of time to wait after the transition,
+            // to avoid accidentally synchronizing with something.
+            double hold_time =
+                HOLD_MIN_TIME +
+                (HOLD_MAX_TIME - HOLD_MIN_TIME) * (rand() / (double)RAND_MAX);
+            a->next_switch_time =
+                advance_time(transition_time, hold_time * 1e9);
+            a->want_switch = true;
+        }
 
         // Update the ringbuffer of transition delays
-        update_fir(a, delay, is_dark);
+        if (!fit) {
+            update_fir(a, delay, is_dark, present_ms);
+        }
+    } else if (a->fit_pending) {
+        a->fit_after++;
+        if (a->fit_after >= FIT_POST_FRAMES) {
+            finish_fit(a, 0);
+        }
     }
 
-    // Change at requested time
-    int display_transition = 0;
+    // Change at requested time. That is judged by the capture time, but
+    // the display only changes once this frame has been dequeued and
+    // analysed, so delays are measured from now.
+    int display_transition = a->pending_switch;
     if (a->want_switch &&
         get_delta_nsec(a->next_switch_time, a->capture_time) >= 0) {
         a->showing_dark = !is_dark;
         display_transition = a->showing_dark ? 1 : -1;
         a->want_switch = false;
+        clock_gettime(CLOCK_MONOTONIC, &a->next_switch_time);
     }
+    note_switch(a, display_transition);
 
     // State logging
-    if (a->log) {
-        fprintf(a->log, "%.9f %.3f %d\n",
-                get_delta_nsec(a->setup_time, meas_time) * 1e-9, meas_level,
-                display_transition);
-    }
+    log_frame(a, meas_time, meas_level, threshold, display_transition,
+              was_dark != is_dark);
 
 end:
+    a->pending_dropped = 0;
+    a->pending_switch = 0;
+    a->pending_backlog = false;
+    if (a->max_time > 0. &&
+        get_delta_nsec(a->setup_time, meas_time) >= a->max_time * 1e9) {
+        a->stopping = true;
+    }
+    if (a->stopping) {
+        return Quit;
+    }
     return a->showing_dark ? DisplayDark : DisplayLight;
 }
+
+void analysis_note_capture(struct analysis *a, double queue_delay_ms,
+                           int dropped) {
+    if (!a->device_timestamps) {
+        return;
+    }
+    delay_stats_add(&a->queue_delay, queue_delay_ms, false);
+    a->dropped_frames += dropped;
+    a->pending_dropped = dropped;
+}
+
+void analysis_note_backlog(struct analysis *a) {
+    a->backlog_frames++;
+    a->pending_backlog = true;
+}
+
+struct timespec analysis_smooth_time(struct analysis *a, int64_t sequence,
+                                     struct timespec t) {
+    if (!a->smoothing) {
+        return t;
+    }
+    int64_t ns = timestamp_filter_update(&a->smoother, sequence,
+                                         timespec_nsec(t));
+    struct timespec out;
+    out.tv_sec = ns / 1000000000;
+    out.tv_nsec = ns % 1000000000;
+    return out;
+}
+
+void analysis_external_switch(struct analysis *a, struct timespec switch_time,
+                              bool to_dark) {
+    a->next_switch_time = switch_time;
+    a->showing_dark = to_dark;
+    a->pending_switch = to_dark ? 1 : -1;
+}
+
+void analysis_note_presentation(struct analysis *a,
+                                const struct present_info *p) {
+    struct present_queue *q = a->presents;
+    uint64_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+    if (head - tail >= PRESENT_QUEUE) {
+        // Frames have stopped; this one could not be matched anyway
+        return;
+    }
+    q->entries[head % PRESENT_QUEUE] = *p;
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+}
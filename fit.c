@@ -0,0 +1,85 @@
+#include "fit.h"
+
+#include <math.h>
+
+// Samples this close to either plateau carry little timing information
+#define FIT_MARGIN 0.05
+
+/* The loops below run over all FIT_FRAMES entries, with masks instead of
+ * branches, so that the compiler can fully unroll and vectorize them; a fit
+ * costs far less than the time between frames. */
+bool fit_crossing(const double *t, const double *level, int n, int npre,
+                  double threshold, bool sigmoid, double *t_cross) {
+    if (npre < 2 || n - npre < 2 || n > FIT_FRAMES) {
+        return false;
+    }
+    // Plateau levels, from the outermost two frames on either side
+    double y_old = 0.5 * (level[0] + level[1]);
+    double y_new = 0.5 * (level[n - 2] + level[n - 1]);
+    double span = y_new - y_old;
+    if (fabs(span) < 1e-3) {
+        return false;
+    }
+    double y_thr = (threshold - y_old) / span;
+    if (y_thr <= 0. || y_thr >= 1.) {
+        return false;
+    }
+
+    // Normalize so the curve rises from 0 to 1; only samples strictly
+    // between the plateaus are used
+    double y[FIT_FRAMES], w[FIT_FRAMES];
+    double count = 0.;
+    for (int i = 0; i < FIT_FRAMES; i++) {
+        double v = (level[i] - y_old) / span;
+        bool inside = i < n && v > FIT_MARGIN && v < 1. - FIT_MARGIN;
+        y[i] = inside ? v : 0.5;
+        w[i] = inside ? 1. : 0.;
+        count += w[i];
+    }
+
+    double t_lo = t[0], t_hi = t[n - 1];
+    if (sigmoid) {
+        // logit(y) = (t - t0) / scale; the variance of logit(y) grows as
+        // 1/(y(1-y))^2, so weight accordingly
+        if (count < 2.) {
+            return false;
+        }
+        double sw = 0., swt = 0., swz = 0., swtt = 0., swtz = 0.;
+        for (int i = 0; i < FIT_FRAMES; i++) {
+            double z = log(y[i] / (1. - y[i]));
+            double q = y[i] * (1. - y[i]);
+            double wi = w[i] * q * q;
+            double ti = w[i] > 0. ? t[i] - t_lo : 0.;
+            sw += wi;
+            swt += wi * ti;
+            swz += wi * z;
+            swtt += wi * ti * ti;
+            swtz += wi * ti * z;
+        }
+        double det = sw * swtt - swt * swt;
+        if (det <= 0.) {
+            return false;
+        }
+        double slope = (sw * swtz - swt * swz) / det;
+        double icept = (swz - slope * swt) / sw;
+        if (slope <= 0.) {
+            return false;
+        }
+        *t_cross = t_lo + (log(y_thr / (1. - y_thr)) - icept) / slope;
+    } else {
+        // A frame ending at t[i] whose exposure of length T started before
+        // a step at ts sees y = (t[i] - ts) / T
+        if (count < 1.) {
+            return false;
+        }
+        double period = (t_hi - t_lo) / (n - 1);
+        double sw = 0., sts = 0.;
+        for (int i = 0; i < FIT_FRAMES; i++) {
+            double ti = w[i] > 0. ? t[i] - t_lo : 0.;
+            sw += w[i];
+            sts += w[i] * (ti - y[i] * period);
+        }
+        *t_cross = t_lo + sts / sw + y_thr * period;
+    }
+    return *t_cross >= t_lo && *t_cross <= t_hi;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Frames kept around each threshold crossing for curve fitting
+#define FIT_PRE_FRAMES 4
+#define FIT_POST_FRAMES 4
+#define FIT_FRAMES (FIT_PRE_FRAMES + FIT_POST_FRAMES)
+
+/* Fit a transition curve to the first `n` <= FIT_FRAMES samples
+ * (t[i], level[i]), of which the first `npre` precede the crossing, and
+ * estimate when it passed `threshold`. Both arrays must have FIT_FRAMES
+ * entries. Times are in seconds, relative to any origin.
+ *
+ * With `sigmoid`, the normalized level is modeled as a logistic curve,
+ * fit by weighted least squares on its logit; otherwise as an instant step
+ * integrated over an exposure lasting one frame period. Returns false if
+ * the samples do not constrain the model. */
+bool fit_crossing(const double *t, const double *level, int n, int npre,
+                  double threshold, bool sigmoid, double *t_cross);
+
+#ifdef __cplusplus
+}
+#endif
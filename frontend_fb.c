@@ -1,4 +1,5 @@
 #include "interface.h"
+#include "quit_signal.h"
 
 #include <stdbool.h>
 #include <stdint.h>
@@ -9,11 +10,80 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <linux/fb.h>
+#include <poll.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+struct patch {
+    int x, y, width, height;
+};
+
+/* Ask for a virtual framebuffer twice the visible height, and check that
+ * the driver can pan between its halves */
+static bool setup_pages(int fbd, struct fb_var_screeninfo *vari,
+                        struct fb_fix_screeninfo *fixi) {
+    if (vari->yres_virtual < 2 * vari->yres) {
+        struct fb_var_screeninfo want = *vari;
+        want.yres_virtual = 2 * vari->yres;
+        want.xoffset = 0;
+        want.yoffset = 0;
+        if (ioctl(fbd, FBIOPUT_VSCREENINFO, &want) == -1 ||
+            ioctl(fbd, FBIOGET_VSCREENINFO, vari) == -1 ||
+            ioctl(fbd, FBIOGET_FSCREENINFO, fixi) == -1) {
+            return false;
+        }
+    }
+    return fixi->ypanstep > 0 && vari->yres % fixi->ypanstep == 0 &&
+           vari->yres_virtual >= 2 * vari->yres &&
+           fixi->smem_len >= (uint64_t)fixi->line_length * 2 * vari->yres;
+}
+
+static int read_patch(const struct fb_var_screeninfo *vari, struct patch *p) {
+    p->x = 0;
+    p->y = 0;
+    p->width = vari->xres;
+    p->height = vari->yres;
+    char *str = getenv("LATENCYTOOL_FB_PATCH");
+    if (!str) {
+        return 0;
+    }
+    char extra;
+    if (sscanf(str, "%d,%d,%d,%d%c", &p->x, &p->y, &p->width, &p->height,
+               &extra) != 4 ||
+        p->x < 0 || p->y < 0 || p->width < 1 || p->height < 1 ||
+        p->x + p->width > (int)vari->xres ||
+        p->y + p->height > (int)vari->yres) {
+        fprintf(stderr,
+                "Invalid LATENCYTOOL_FB_PATCH '%s', must be "
+                "'x,y,width,height' within %dx%d\n",
+                str, vari->xres, vari->yres);
+        return -1;
+    }
+    return 0;
+}
+
+/* Fill a rectangle of the visible area, starting from line `top` of the
+ * virtual framebuffer */
+static void fill(uint8_t *mem, const struct fb_var_screeninfo *vari,
+                 const struct fb_fix_screeninfo *fixi, int top,
+                 const struct patch *p, bool dark) {
+    int bytes = (vari->bits_per_pixel + 7) / 8;
+    for (int y = p->y; y < p->y + p->height; y++) {
+        uint8_t *row = mem + (size_t)(top + y) * fixi->line_length +
+                       (size_t)(vari->xoffset + p->x) * bytes;
+        memset(row, dark ? 0 : 255, (size_t)p->width * bytes);
+    }
+}
+
+/* The frame period, from the pixel clock in picoseconds, or 0 */
+static int64_t refresh_period(const struct fb_var_screeninfo *v) {
+    int64_t htotal = v->xres + v->left_margin + v->right_margin + v->hsync_len;
+    int64_t vtotal = v->yres + v->upper_margin + v->lower_margin + v->vsync_len;
+    return htotal * vtotal * v->pixclock / 1000;
+}
+
 int main(int argc, char **argv) {
     int camera_number = 0;
     if (argc != 2 || sscanf(argv[1], "%d", &camera_number) != 1) {
@@ -26,6 +96,9 @@ int main(int argc, char **argv) {
         return EXIT_FAILURE;
     }
 
+    // Ctrl+C then still restores the screen mode and the camera controls
+    catch_quit_signals();
+
     __uid_t uid = geteuid();
     if (uid == 0) {
         fprintf(stderr, "Please do not run this program as root.\n");
@@ -50,39 +123,113 @@ int main(int argc, char **argv) {
         fprintf(stderr, "Failed to read variable screen data\n");
         return EXIT_FAILURE;
     }
+    // Restored at exit
+    struct fb_var_screeninfo original = vari;
+
+    // Switching colors pans between a light and a dark page, filled once;
+    // otherwise each switch fills a patch of the visible area
+    bool panning = setup_pages(fbd, &vari, &fixi);
+    int status = EXIT_FAILURE;
+    struct patch patch;
+    if (read_patch(&vari, &patch) < 0) {
+        goto restore;
+    }
+    char *vsyncstr = getenv("LATENCYTOOL_FB_VSYNC");
+    bool vsync = panning && vsyncstr && atoi(vsyncstr);
 
     fprintf(stderr, "screen virt xres = %d, yres = %d\n", vari.xres_virtual,
             vari.yres_virtual);
     fprintf(stderr, "screen data length %d\n", fixi.smem_len);
-    uint32_t *mem =
-        (uint32_t *)mmap(0, fixi.smem_len, PROT_WRITE, MAP_SHARED, fbd, 0);
+    uint8_t *mem =
+        (uint8_t *)mmap(0, fixi.smem_len, PROT_WRITE, MAP_SHARED, fbd, 0);
     if (mem == MAP_FAILED) {
         fprintf(stderr, "Failed to map screen device: %s\n", strerror(errno));
-        return EXIT_FAILURE;
+        goto restore;
+    }
+
+    struct fb_var_screeninfo pan = vari;
+    if (panning) {
+        fprintf(stderr, "Switching by panning between two pages%s\n",
+                vsync ? ", then waiting for vsync" : "");
+        struct patch page = {0, 0, vari.xres, vari.yres};
+        fill(mem, &vari, &fixi, 0, &page, false);
+        fill(mem, &vari, &fixi, vari.yres, &page, true);
+        pan.xoffset = 0;
+        pan.yoffset = vari.yres;
+        if (ioctl(fbd, FBIOPAN_DISPLAY, &pan) == -1) {
+            fprintf(stderr, "Failed to pan display: %s\n", strerror(errno));
+            panning = false;
+        }
+    }
+    if (!panning) {
+        fprintf(stderr, "Panning unsupported; filling %dx%d at %d,%d\n",
+                patch.width, patch.height, patch.x, patch.y);
+        fill(mem, &vari, &fixi, vari.yoffset, &patch, true);
     }
 
     void *state = setup_backend(camera_number);
     if (!state) {
         fprintf(stderr, "Failed to open camera #%d", camera_number);
-        return EXIT_FAILURE;
+        goto unmap;
     }
 
     bool was_dark = true;
-    // note: cancel the loop with Ctrl+C
-    while (1) {
-        // todo: 1ms pause?
+    // Backends with a capture thread signal this fd; others are polled
+    int event_fd = backend_event_fd(state);
+    // note: cancel the loop with Ctrl+C, unless the backend ends it
+    while (!quit_requested()) {
+        if (event_fd >= 0) {
+            struct pollfd pfd = {event_fd, POLLIN, 0};
+            poll(&pfd, 1, -1);
+        }
         enum WhatToDo wtd = update_backend(state);
+        if (wtd == Quit) {
+            break;
+        }
         bool is_dark = wtd == DisplayDark;
-        if (is_dark != was_dark) {
-            was_dark = is_dark;
+        if (is_dark == was_dark) {
+            continue;
+        }
+        was_dark = is_dark;
+        if (!panning) {
+            fill(mem, &vari, &fixi, vari.yoffset, &patch, is_dark);
+            continue;
+        }
 
-            memset(mem, is_dark ? 0 : 255, fixi.smem_len);
+        pan.yoffset = is_dark ? vari.yres : 0;
+        if (ioctl(fbd, FBIOPAN_DISPLAY, &pan) == -1) {
+            fprintf(stderr, "Failed to pan display: %s\n", strerror(errno));
+            break;
+        }
+        if (!vsync) {
+            continue;
+        }
+        // Drivers latch the new offset at the next vertical blank, which
+        // is when the new page starts to be scanned out
+        uint32_t crtc = 0;
+        if (ioctl(fbd, FBIO_WAITFORVSYNC, &crtc) == -1) {
+            fprintf(stderr, "Failed to wait for vsync: %s\n",
+                    strerror(errno));
+            vsync = false;
+            continue;
         }
+        struct present_info p;
+        memset(&p, 0, sizeof(p));
+        clock_gettime(CLOCK_MONOTONIC, &p.time);
+        p.to_dark = is_dark;
+        p.refresh_ns = refresh_period(&vari);
+        p.flags = PRESENT_VSYNC | PRESENT_ZERO_COPY;
+        backend_note_presentation(state, &p);
     }
+    cleanup_backend(state);
+    status = EXIT_SUCCESS;
 
+unmap:
     munmap(mem, fixi.smem_len);
+restore:
+    if (panning || vari.yres_virtual != original.yres_virtual) {
+        ioctl(fbd, FBIOPUT_VSCREENINFO, &original);
+    }
     close(fbd);
-
-    cleanup_backend(state);
-    return EXIT_SUCCESS;
+    return status;
 }
@@ -1,4 +1,5 @@
 #include "interface.h"
+#include "quit_signal.h"
 
 #include <iostream>
 #include <stdlib.h>
@@ -7,6 +8,7 @@
 #include <QCommandLineParser>
 #include <QPaintEvent>
 #include <QPainter>
+#include <QSocketNotifier>
 #include <QTimer>
 #include <QWidget>
 
@@ -21,10 +23,20 @@ class MainWindow : public QWidget {
         setAttribute(Qt::WA_PaintUnclipped);
         // TODO: add mode with WA_PaintOnScreen ?
 
-        timer.setSingleShot(false);
-        timer.setInterval(2);
-        timer.start();
-        connect(&timer, &QTimer::timeout, this, &MainWindow::checkCamera);
+        // Backends with a capture thread signal an fd; others are polled
+        int event_fd = backend_event_fd(state);
+        notifier = NULL;
+        if (event_fd >= 0) {
+            notifier =
+                new QSocketNotifier(event_fd, QSocketNotifier::Read, this);
+            connect(notifier, &QSocketNotifier::activated, this,
+                    &MainWindow::checkCamera);
+        } else {
+            timer.setSingleShot(false);
+            timer.setInterval(2);
+            timer.start();
+            connect(&timer, &QTimer::timeout, this, &MainWindow::checkCamera);
+        }
     }
 
     virtual void paintEvent(QPaintEvent *event) override {
@@ -37,7 +49,15 @@ class MainWindow : public QWidget {
     }
   public slots:
     void checkCamera() {
-        enum WhatToDo wtd = update_backend(state);
+        enum WhatToDo wtd = quit_requested() ? Quit : update_backend(state);
+        if (wtd == Quit) {
+            timer.stop();
+            if (notifier) {
+                notifier->setEnabled(false);
+            }
+            QApplication::quit();
+            return;
+        }
         bool next_dark = wtd == DisplayDark;
         if (next_dark != screen_dark) {
             screen_dark = next_dark;
@@ -47,6 +67,7 @@ class MainWindow : public QWidget {
 
   private:
     QTimer timer;
+    QSocketNotifier *notifier;
     void *state;
     bool screen_dark;
 };
@@ -77,6 +98,7 @@ int main(int argc, char **argv) {
         return EXIT_FAILURE;
     }
 
+    catch_quit_signals();
     void *state = setup_backend(camera_number);
     if (!state) {
         qDebug("Failed to open camera #%d", camera_number);
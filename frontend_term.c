@@ -1,9 +1,12 @@
 #include "interface.h"
+#include "quit_signal.h"
 
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <poll.h>
+
 #define ESC "\x1b["
 #if 0
 // For normal color schemes (with a true black and true white)
@@ -33,6 +36,7 @@ int main(int argc, char **argv) {
         return EXIT_FAILURE;
     }
 
+    catch_quit_signals();
     void *state = setup_backend(camera_number);
     if (!state) {
         fprintf(stderr, "Failed to open camera #%d", camera_number);
@@ -45,10 +49,18 @@ int main(int argc, char **argv) {
     bool was_dark = true;
     fprintf(stderr, BLACK);
 
-    // note: cancel the loop with Ctrl+C
-    while (1) {
-        // todo: 1ms pause?
+    // Backends with a capture thread signal this fd; others are polled
+    int event_fd = backend_event_fd(state);
+    // note: cancel the loop with Ctrl+C, unless the backend ends it
+    while (!quit_requested()) {
+        if (event_fd >= 0) {
+            struct pollfd pfd = {event_fd, POLLIN, 0};
+            poll(&pfd, 1, -1);
+        }
         enum WhatToDo wtd = update_backend(state);
+        if (wtd == Quit) {
+            break;
+        }
         bool is_dark = wtd == DisplayDark;
         if (is_dark != was_dark) {
             was_dark = is_dark;
@@ -1,4 +1,5 @@
 #include "interface.h"
+#include "quit_signal.h"
 
 #include <fcntl.h>
 #include <stdio.h>
@@ -14,6 +15,8 @@
 
 #include "obj/xdg-shell-stable-client-protocol.h"
 #include "obj/linux-dmabuf-unstable-v1-client-protocol.h"
+#include "obj/tearing-control-v1-client-protocol.h"
+#include "wayland_presentation.h"
 #include <wayland-client.h>
 
 struct globals {
@@ -28,6 +31,10 @@ struct globals {
     struct wl_callback *frame_callback;
     struct wl_callback_listener frame_listener;
     struct gbm_device *gbm;
+    struct wp_tearing_control_manager_v1 *tearing;
+    struct wp_tearing_control_v1 *tearing_control;
+    struct presentation presentation;
+    int committed_dark; // the color of the last commit, or -1
     int32_t width, height;
     int size_changed;
     int is_dark;
@@ -93,6 +100,13 @@ static void registry_add(void *data, struct wl_registry *wl_registry,
         glob->dmabuf =
             wl_registry_bind(glob->registry, name, &zwp_linux_dmabuf_v1_interface, 3);
     }
+    if (!strcmp(wp_tearing_control_manager_v1_interface.name, interface)) {
+        glob->tearing = wl_registry_bind(
+            glob->registry, name, &wp_tearing_control_manager_v1_interface, 1);
+    }
+    if (!strcmp(wp_presentation_interface.name, interface)) {
+        presentation_bind(&glob->presentation, glob->registry, name);
+    }
 }
 
 static void registry_remove(void *data, struct wl_registry *wl_registry,
@@ -131,6 +145,11 @@ static void update_surface(void *data, struct wl_callback *wl_callback,
     }
     glob->frame_callback = wl_surface_frame(glob->surface);
     wl_callback_add_listener(glob->frame_callback, &glob->frame_listener, glob);
+    if (glob->is_dark != glob->committed_dark) {
+        presentation_request(&glob->presentation, glob->surface,
+                             glob->is_dark);
+        glob->committed_dark = glob->is_dark;
+    }
     wl_surface_commit(glob->surface);
 }
 
@@ -168,12 +187,6 @@ int main(int argc, char **argv) {
         return EXIT_FAILURE;
     }
 
-    void *state = setup_backend(camera_number);
-    if (!state) {
-        fprintf(stderr, "Failed to open camera #%d", camera_number);
-        return EXIT_FAILURE;
-    }
-
     struct wl_display *display = wl_display_connect(NULL);
     if (!display) {
         fprintf(stderr, "Failed to connect to a display\n");
@@ -186,6 +199,7 @@ int main(int argc, char **argv) {
     glob.height = SMALL_WINDOW_SIZE;
     glob.size_changed = 1;
     glob.is_running = 1;
+    glob.committed_dark = -1;
     glob.registry = wl_display_get_registry(display);
     struct wl_registry_listener reg_listen = {&registry_add, &registry_remove};
     wl_registry_add_listener(glob.registry, &reg_listen, &glob);
@@ -218,6 +232,25 @@ int main(int argc, char **argv) {
         return EXIT_FAILURE;
     }
 
+    // The hint applies from the first commit. Compositors may still hold
+    // async commits for vblank; the Display: line says whether they did
+    char *tearstr = getenv("LATENCYTOOL_TEARING");
+    bool tearing = tearstr && atoi(tearstr);
+    if (tearing && !glob.tearing) {
+        fprintf(stderr, "Compositor lacks wp_tearing_control_v1\n");
+        return EXIT_FAILURE;
+    }
+    if (glob.tearing) {
+        glob.tearing_control =
+            wp_tearing_control_manager_v1_get_tearing_control(glob.tearing,
+                                                              glob.surface);
+        wp_tearing_control_v1_set_presentation_hint(
+            glob.tearing_control,
+            tearing ? WP_TEARING_CONTROL_V1_PRESENTATION_HINT_ASYNC
+                    : WP_TEARING_CONTROL_V1_PRESENTATION_HINT_VSYNC);
+        analysis_set_present_mode(tearing ? "async" : "vsync");
+    }
+
     glob.frame_listener.done = update_surface;
 
     glob.xdg_surface = xdg_wm_base_get_xdg_surface(glob.wm_base, glob.surface);
@@ -232,31 +265,56 @@ int main(int argc, char **argv) {
     xdg_toplevel_set_title(xdg_toplevel, "wayland shm frontend");
     wl_surface_commit(glob.surface);
 
+    // Only now, so that failures above leave the camera as it was
+    catch_quit_signals();
+    void *state = setup_backend(camera_number);
+    if (!state) {
+        fprintf(stderr, "Failed to open camera #%d", camera_number);
+        return EXIT_FAILURE;
+    }
+    glob.presentation.backend = state;
+
+    // Backends with a capture thread signal this fd; others are polled
+    int event_fd = backend_event_fd(state);
     struct timespec old_time;
     clock_gettime(CLOCK_MONOTONIC, &old_time);
-    while (glob.is_running) {
+    while (glob.is_running && !quit_requested()) {
         if (wl_display_dispatch_pending(display) == -1 ||
             wl_display_flush(display) == -1) {
             break;
         }
 
-        struct pollfd fds[1];
+        struct pollfd fds[2];
         fds[0].fd = wl_display_get_fd(display);
         fds[0].events = POLLIN;
         fds[0].revents = 0;
-        poll(fds, sizeof fds / sizeof fds[0], 1); // wait up to 1 ms
+        fds[1].fd = event_fd; // ignored by poll if negative
+        fds[1].events = POLLIN;
+        fds[1].revents = 0;
+        // wait up to 1 ms, unless the backend wakes us
+        poll(fds, sizeof fds / sizeof fds[0], event_fd >= 0 ? -1 : 1);
 
         if (fds[0].revents && wl_display_dispatch(display) == -1) {
             break;
         }
 
-        struct timespec new_time;
-        clock_gettime(CLOCK_MONOTONIC, &new_time);
-        double time_difference = (new_time.tv_sec - old_time.tv_sec) * 1.0 +
-                                 (new_time.tv_nsec - old_time.tv_nsec) * 1e-9;
-        if (time_difference > 0.001) {
-            old_time = new_time;
+        bool backend_ready = fds[1].revents != 0;
+        if (event_fd < 0) {
+            struct timespec new_time;
+            clock_gettime(CLOCK_MONOTONIC, &new_time);
+            double time_difference =
+                (new_time.tv_sec - old_time.tv_sec) * 1.0 +
+                (new_time.tv_nsec - old_time.tv_nsec) * 1e-9;
+            if (time_difference > 0.001) {
+                old_time = new_time;
+                backend_ready = true;
+            }
+        }
+        if (backend_ready) {
             enum WhatToDo wtd = update_backend(state);
+            if (wtd == Quit) {
+                break;
+            }
             int next_dark = wtd == DisplayDark;
             if (next_dark != glob.is_dark) {
                 glob.is_dark = next_dark;
@@ -266,6 +324,11 @@ int main(int argc, char **argv) {
         }
     }
 
+    presentation_cleanup(&glob.presentation);
+    if (glob.tearing_control) {
+        wp_tearing_control_v1_destroy(glob.tearing_control);
+        wp_tearing_control_manager_v1_destroy(glob.tearing);
+    }
     gbm_device_destroy(glob.gbm);
     close(drm_fd);
     wl_display_disconnect(display);
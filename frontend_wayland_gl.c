@@ -1,4 +1,5 @@
 #include "interface.h"
+#include "quit_signal.h"
 
 #include <fcntl.h>
 #include <stdio.h>
@@ -15,6 +16,7 @@
 #include <GL/gl.h>
 
 #include "obj/xdg-shell-stable-client-protocol.h"
+#include "wayland_presentation.h"
 #include <wayland-client.h>
 #include <wayland-egl-core.h>
 
@@ -31,6 +33,8 @@ struct globals {
     EGLConfig egl_config;
     EGLContext egl_context;
     EGLSurface egl_surface;
+    struct presentation presentation;
+    int committed_dark; // the color of the last commit, or -1
     int32_t width, height;
     int size_changed;
     int is_dark;
@@ -50,6 +54,9 @@ static void registry_add(void *data, struct wl_registry *wl_registry,
         glob->compositor =
             wl_registry_bind(glob->registry, name, &wl_compositor_interface, 1);
     }
+    if (!strcmp("wp_presentation", interface)) {
+        presentation_bind(&glob->presentation, glob->registry, name);
+    }
 }
 
 static void registry_remove(void *data, struct wl_registry *wl_registry,
@@ -71,6 +78,12 @@ static void update_surface(void *data, struct wl_callback *wl_callback,
         glClearColor(1.0, 1.0, 1.0, 1.0);
     }
     glClear(GL_COLOR_BUFFER_BIT);
+    // eglSwapBuffers commits the surface
+    if (glob->is_dark != glob->committed_dark) {
+        presentation_request(&glob->presentation, glob->surface,
+                             glob->is_dark);
+        glob->committed_dark = glob->is_dark;
+    }
     if (!eglSwapBuffers(glob->egl_display, glob->egl_surface)) {
         glob->is_running = 0;
         fprintf(stderr, "Failed to swap buffers\n");
@@ -156,12 +169,6 @@ int main(int argc, char **argv) {
         return EXIT_FAILURE;
     }
 
-    void *state = setup_backend(camera_number);
-    if (!state) {
-        fprintf(stderr, "Failed to open camera #%d", camera_number);
-        return EXIT_FAILURE;
-    }
-
     struct wl_display *display = wl_display_connect(NULL);
     if (!display) {
         fprintf(stderr, "Failed to connect to a display\n");
@@ -174,6 +181,7 @@ int main(int argc, char **argv) {
     glob.height = SMALL_WINDOW_SIZE;
     glob.size_changed = 1;
     glob.is_running = 1;
+    glob.committed_dark = -1;
     glob.registry = wl_display_get_registry(display);
     struct wl_registry_listener reg_listen = {&registry_add, &registry_remove};
     wl_registry_add_listener(glob.registry, &reg_listen, &glob);
@@ -241,31 +249,56 @@ int main(int argc, char **argv) {
     xdg_toplevel_set_title(xdg_toplevel, "wayland shm frontend");
     wl_surface_commit(glob.surface);
 
+    // Only now, so that failures above leave the camera as it was
+    catch_quit_signals();
+    void *state = setup_backend(camera_number);
+    if (!state) {
+        fprintf(stderr, "Failed to open camera #%d", camera_number);
+        return EXIT_FAILURE;
+    }
+    glob.presentation.backend = state;
+
+    // Backends with a capture thread signal this fd; others are polled
+    int event_fd = backend_event_fd(state);
     struct timespec old_time;
     clock_gettime(CLOCK_MONOTONIC, &old_time);
-    while (glob.is_running) {
+    while (glob.is_running && !quit_requested()) {
         if (wl_display_dispatch_pending(display) == -1 ||
             wl_display_flush(display) == -1) {
             break;
         }
 
-        struct pollfd fds[1];
+        struct pollfd fds[2];
         fds[0].fd = wl_display_get_fd(display);
         fds[0].events = POLLIN;
         fds[0].revents = 0;
-        poll(fds, sizeof fds / sizeof fds[0], 1); // wait up to 1 ms
+        fds[1].fd = event_fd; // ignored by poll if negative
+        fds[1].events = POLLIN;
+        fds[1].revents = 0;
+        // wait up to 1 ms, unless the backend wakes us
+        poll(fds, sizeof fds / sizeof fds[0], event_fd >= 0 ? -1 : 1);
 
         if (fds[0].revents && wl_display_dispatch(display) == -1) {
             break;
         }
 
-        struct timespec new_time;
-        clock_gettime(CLOCK_MONOTONIC, &new_time);
-        double time_difference = (new_time.tv_sec - old_time.tv_sec) * 1.0 +
-                                 (new_time.tv_nsec - old_time.tv_nsec) * 1e-9;
-        if (time_difference > 0.001) {
-            old_time = new_time;
+        bool backend_ready = fds[1].revents != 0;
+        if (event_fd < 0) {
+            struct timespec new_time;
+            clock_gettime(CLOCK_MONOTONIC, &new_time);
+            double time_difference =
+                (new_time.tv_sec - old_time.tv_sec) * 1.0 +
+                (new_time.tv_nsec - old_time.tv_nsec) * 1e-9;
+            if (time_difference > 0.001) {
+                old_time = new_time;
+                backend_ready = true;
+            }
+        }
+        if (backend_ready) {
             enum WhatToDo wtd = update_backend(state);
+            if (wtd == Quit) {
+                break;
+            }
             int next_dark = wtd == DisplayDark;
             if (next_dark != glob.is_dark) {
                 glob.is_dark = next_dark;
@@ -275,6 +308,7 @@ int main(int argc, char **argv) {
         }
     }
 
+    presentation_cleanup(&glob.presentation);
     wl_display_disconnect(display);
     cleanup_backend(state);
     return EXIT_SUCCESS;
@@ -1,4 +1,5 @@
 #include "interface.h"
+#include "quit_signal.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -17,6 +18,7 @@ int main(int argc, char **argv) {
         return EXIT_FAILURE;
     }
 
+    catch_quit_signals();
     void *state = setup_backend(camera_number);
     if (!state) {
         fprintf(stderr, "Failed to open camera #%d", camera_number);
@@ -51,12 +53,23 @@ int main(int argc, char **argv) {
     int quitting = 0;
     xcb_generic_event_t *event;
     int fdes = xcb_get_file_descriptor(connection);
+    // Backends with a capture thread signal this fd; others are polled
+    int event_fd = backend_event_fd(state);
+    int nfds = (event_fd > fdes ? event_fd : fdes) + 1;
     struct timespec timeout = {0, 1000000}; // 1ms tick, accuracy unimportant
     fd_set fds;
     while (1) {
         FD_ZERO(&fds);
         FD_SET(fdes, &fds);
-        if (pselect(fdes + 1, &fds, NULL, NULL, &timeout, NULL) > 0) {
+        if (event_fd >= 0) {
+            FD_SET(event_fd, &fds);
+        }
+        int ready = pselect(nfds, &fds, NULL, NULL,
+                            event_fd >= 0 ? NULL : &timeout, NULL);
+        bool backend_ready = event_fd >= 0
+                                 ? ready > 0 && FD_ISSET(event_fd, &fds)
+                                 : ready <= 0;
+        if (ready > 0 && FD_ISSET(fdes, &fds)) {
             // We assume no overflow
             if ((event = xcb_poll_for_event(connection))) {
                 switch (event->response_type & ~0x80) {
@@ -81,9 +94,13 @@ int main(int argc, char **argv) {
                     break; // Unimportant
                 }
             }
-        } else {
+        }
+        if (backend_ready) {
             // Poll the backend.
             enum WhatToDo wtd = update_backend(state);
+            if (wtd == Quit) {
+                break;
+            }
             is_dark = wtd == DisplayDark;
 
             values[0] = is_dark ? screen->black_pixel : screen->white_pixel;
@@ -92,7 +109,7 @@ int main(int argc, char **argv) {
             xcb_clear_area(connection, 0, window, 0, 0, 0, 0);
             xcb_flush(connection);
         }
-        if (quitting) {
+        if (quitting || quit_requested()) {
             break;
         }
     }
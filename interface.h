@@ -1,43 +1,205 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <time.h>
 
+#include "fit.h"
+#include "logfile.h"
+#include "reporter.h"
+#include "smooth.h"
+#include "stats.h"
+#include "threshold.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 #define SMALL_WINDOW_SIZE 400
 
-enum WhatToDo { DisplayDark, DisplayLight };
+// Quit: the measurement is complete; the frontend should clean up and exit
+enum WhatToDo { DisplayDark, DisplayLight, Quit };
+// How the time a camera level crossed the threshold is estimated
+enum Interpolation {
+    InterpolateNone,
+    InterpolateLinear,
+    InterpolateStep,    // fit over several frames, see fit.h
+    InterpolateSigmoid, // fit over several frames, see fit.h
+    NumInterpolations
+};
+// Reasons for the display to alternate open-loop, while calibrating
+#define FLICKER_THRESHOLD 0x1
+#define FLICKER_ROI 0x2
+#define FLICKER_EXPOSURE 0x4
+// For passive analyses: the display flickers for another analysis
+#define FLICKER_EXTERNAL 0x8
 void *setup_backend(int camera);
 enum WhatToDo update_backend(void *state);
 void cleanup_backend(void *state);
+/* A file descriptor that becomes readable when update_backend has a new
+ * value, for backends that capture on their own thread; -1 if the frontend
+ * must keep calling update_backend. */
+int backend_event_fd(void *state);
+
+/* When a display change reached the screen, for frontends that can tell */
+struct present_info {
+    struct timespec time; // CLOCK_MONOTONIC, when its scanout started
+    bool to_dark;         // the color now shown
+    int64_t refresh_ns;   // refresh period of the display, or 0 if unknown
+    uint64_t msc;         // count of vertical retraces, or 0 if unknown
+    uint32_t flags;       // PRESENT_*
+};
+// As for wp_presentation: the change waited for vertical retrace; its time
+// comes from the display hardware clock; the hardware signalled completion;
+// the frontend's buffer was scanned out without a copy
+#define PRESENT_VSYNC 0x1
+#define PRESENT_HW_CLOCK 0x2
+#define PRESENT_HW_COMPLETION 0x4
+#define PRESENT_ZERO_COPY 0x8
+/* Called by the frontend for each such change; it may capture on another
+ * thread, so backends must only queue the information */
+void backend_note_presentation(void *state, const struct present_info *p);
+/* For frontends that choose how display switches are presented: call
+ * before setup_backend with the mode applied, "vsync" or "async", to label
+ * the run with it. Runs of other frontends are unlabelled. */
+void analysis_set_present_mode(const char *mode);
+
+struct present_queue;
 
 struct analysis {
     // Analysis of delays
     double current_camera_level; // What color did the camera last see?
     int showing_dark;            // What color should the screen show now?
     int want_switch;             // Is a time scheduled to switch screen colors?
+    bool passive; // Are switches decided elsewhere, not scheduled here?
+    int pending_switch; // external display transition, for the next record
+    enum Interpolation interp;
     struct timespec capture_time;
     struct timespec next_switch_time;
+    unsigned flicker; // FLICKER_* reasons to ignore the camera, if any
+    uint64_t flicker_frames;
+    struct timespec flicker_start; // time of the first flickering frame
+
+    // Light/dark threshold selection
+    double fixed_threshold; // overrides the backend's value, if > 0
+    bool auto_threshold;
+    struct threshold_tracker tracker;
+    double reported_threshold;
 
     // Analysis of delays
-    double *fir;
-    int fir_head;
-    int nframes;
+    struct delay_stats stats;
+    int ntransitions;
+
+    // Automatic end of the measurement; disabled if zero
+    double ci_target; // ms, half-width of the 95% intervals of mean delays
+    double max_time;  // seconds since setup
+    bool stopping;
+    bool converged;
+
+    // Capture path, for backends with device timestamps
+    bool device_timestamps;
+    struct delay_stats queue_delay; // ms from device timestamp to dequeue
+    uint64_t nframes;
+    uint64_t dropped_frames;
+    int pending_dropped; // for the next frame's log record
+    uint64_t backlog_frames;
+    bool pending_backlog; // for the next frame's log record
+    bool smoothing;
+    struct timestamp_filter smoother;
 
-    // To record raw data to file
+    // Recent frames, and a crossing waiting for later frames to be fit
+    int64_t recent_ns[FIT_FRAMES + 1];
+    double recent_level[FIT_FRAMES + 1];
+    uint64_t nrecent;
+    bool fit_pending;
+    bool fit_to_dark;
+    int fit_after; // frames since the crossing, inclusive
+    double fit_threshold;
+    int64_t fit_switch_ns; // time of the switch the crossing responds to
+    int64_t fit_linear_ns; // fallback estimate of the crossing time
+
+    // Display switches as the frontend presented them, if it reports that
+    struct present_queue *presents;
+    bool presenting; // whether any presentation has been reported
+    uint64_t presentations;
+    uint32_t present_flags; // of the latest presentation
+    int64_t refresh_ns;
+    struct timespec switch_time; // of the latest display switch
+    bool switch_to_dark;
+    double switch_present_ms; // from that switch to its scanout, or -1
+    double fit_present_ms;    // the same, for the pending crossing
+    struct delay_stats present_delay; // ms from switch to scanout
+    struct delay_stats scanout_delay; // ms from scanout to camera crossing
+
+    // To record raw data to file, and print results, off the capture path
     struct timespec setup_time;
-    FILE *log;
+    bool logging;
+    struct reporter *reporter;
+    char prefix[REPORT_PREFIX_LENGTH]; // of console output
+};
+
+// Description of the camera, recorded in the log header
+struct capture_info {
+    int camera;
+    double fps;       // nominal frame rate
+    double threshold; // nominal light/dark threshold
+    int timestamp_source; // LOG_TIMESTAMP_*, for the capture times
 };
 
-int setup_analysis(struct analysis *a);
+struct analysis_options {
+    int window; // transitions in the statistics window
+    enum Interpolation interp;
+    double threshold;    // overrides the backend's value, if > 0
+    bool auto_threshold; // calibrate and track the threshold from levels
+    double ci_target;    // stop when mean delays are known this well (ms)
+    double max_time;     // stop after this many seconds
+    double smooth;       // time constant of timestamp smoothing, if > 0
+    const char *log_path; // binary log destination, or NULL
+    const char *label;    // stored in the log header, or NULL
+    const char *prefix;   // starts each line of console output, or NULL
+    const char *present_mode; // "vsync" or "async" as applied, or NULL
+    bool quiet;           // if set, no log or console output at all
+    bool passive; // if set, only analysis_external_switch changes the display
+};
+
+/* Fill options with defaults, overridden by LATENCYTOOL_* variables */
+int read_analysis_options(struct analysis_options *o);
+const char *interpolation_name(enum Interpolation interp);
+int parse_interpolation(const char *name, enum Interpolation *interp);
+
+int setup_analysis(struct analysis *a, const struct capture_info *info);
+int setup_analysis_opts(struct analysis *a, const struct capture_info *info,
+                        const struct analysis_options *opts);
 void cleanup_analysis(struct analysis *a);
 enum WhatToDo update_analysis(struct analysis *s,
                               struct timespec measurement_time,
                               double measurement, double threshold);
+/* While any flicker reason is set, the display alternates at a fixed rate,
+ * independent of the camera, and no delays are recorded; passive analyses
+ * only stop recording delays. Clearing a reason
+ * other than FLICKER_THRESHOLD means the levels may have changed scale, so
+ * an automatic threshold is calibrated again. */
+void analysis_set_flicker(struct analysis *a, unsigned reason, bool on);
+/* For backends with device timestamps, called before update_analysis for
+ * each frame: how long after its timestamp the frame was dequeued, and how
+ * many frames the device dropped just before it */
+void analysis_note_capture(struct analysis *a, double queue_delay_ms,
+                           int dropped);
+/* Called before update_analysis for a frame that was already queued behind
+ * a newer one when the backend got to it */
+void analysis_note_backlog(struct analysis *a);
+/* If enabled, replace a frame's capture time by a fit of recent capture
+ * times against frame sequence numbers, see smooth.h */
+struct timespec analysis_smooth_time(struct analysis *a, int64_t sequence,
+                                     struct timespec t);
+/* Queue a presentation, to be matched with the display switch it shows
+ * when the next frame is analysed. Lock-free, for one producer thread. */
+void analysis_note_presentation(struct analysis *a,
+                                const struct present_info *p);
+/* Record a display switch made at the given time; for passive analyses */
+void analysis_external_switch(struct analysis *a, struct timespec switch_time,
+                              bool to_dark);
 
 inline int64_t get_delta_nsec(const struct timespec x0,
                               const struct timespec x1) {
@@ -0,0 +1,150 @@
+#include "logfile.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* The file is extended and remapped in steps of this size; at 187 fps,
+ * each step holds about fifteen minutes of records */
+#define LOG_CHUNK_SIZE (4 << 20)
+
+static int writer_map(struct log_writer *w, size_t size) {
+    if (w->map) {
+        munmap(w->map, w->map_size);
+        w->map = NULL;
+        w->header = NULL;
+    }
+    if (ftruncate(w->fd, size) == -1) {
+        fprintf(stderr, "Failed to resize log file: %s\n", strerror(errno));
+        return -1;
+    }
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, w->fd, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Failed to map log file: %s\n", strerror(errno));
+        return -1;
+    }
+    w->map = (uint8_t *)map;
+    w->map_size = size;
+    w->header = (struct log_header *)map;
+    return 0;
+}
+
+int log_writer_open(struct log_writer *w, const char *path,
+                    const struct log_header *header) {
+    memset(w, 0, sizeof(*w));
+    w->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (w->fd == -1) {
+        fprintf(stderr, "Failed to open log file at %s: %s\n", path,
+                strerror(errno));
+        return -1;
+    }
+    if (writer_map(w, LOG_CHUNK_SIZE) < 0) {
+        close(w->fd);
+        return -1;
+    }
+    memcpy(w->header, header, sizeof(*header));
+    memcpy(w->header->magic, LOG_MAGIC, sizeof(LOG_MAGIC));
+    w->header->version = LOG_VERSION;
+    w->header->header_size = sizeof(struct log_header);
+    w->header->record_size = sizeof(struct log_record);
+    w->header->nrecords = 0;
+    return 0;
+}
+
+int log_writer_append(struct log_writer *w, const struct log_record *r) {
+    if (!w->map) {
+        return -1;
+    }
+    size_t offset = sizeof(struct log_header) +
+                    w->header->nrecords * sizeof(struct log_record);
+    if (offset + sizeof(struct log_record) > w->map_size) {
+        if (writer_map(w, w->map_size + LOG_CHUNK_SIZE) < 0) {
+            return -1;
+        }
+    }
+    memcpy(w->map + offset, r, sizeof(*r));
+    w->header->nrecords++;
+    return 0;
+}
+
+void log_writer_close(struct log_writer *w) {
+    if (w->map) {
+        size_t used = sizeof(struct log_header) +
+                      w->header->nrecords * sizeof(struct log_record);
+        munmap(w->map, w->map_size);
+        // Drop the unused tail of the last chunk
+        if (ftruncate(w->fd, used) == -1) {
+            fprintf(stderr, "Failed to trim log file: %s\n", strerror(errno));
+        }
+    }
+    close(w->fd);
+    memset(w, 0, sizeof(*w));
+    w->fd = -1;
+}
+
+int log_reader_open(struct log_reader *r, const char *path) {
+    memset(r, 0, sizeof(*r));
+    r->fd = open(path, O_RDONLY);
+    if (r->fd == -1) {
+        fprintf(stderr, "Failed to open log file at %s: %s\n", path,
+                strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(r->fd, &st) == -1 ||
+        (size_t)st.st_size < LOG_HEADER_V1_SIZE) {
+        fprintf(stderr, "File at %s is too short to be a log\n", path);
+        goto fail;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, r->fd, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Failed to map log file: %s\n", strerror(errno));
+        goto fail;
+    }
+    r->map = (const uint8_t *)map;
+    r->map_size = st.st_size;
+    const struct log_header *h = (const struct log_header *)map;
+    if (memcmp(h->magic, LOG_MAGIC, sizeof(LOG_MAGIC)) != 0) {
+        fprintf(stderr, "File at %s is not a binary log\n", path);
+        goto fail_map;
+    }
+    if (h->version > LOG_VERSION || h->header_size < LOG_HEADER_V1_SIZE ||
+        h->header_size > r->map_size ||
+        h->record_size < LOG_RECORD_V2_SIZE) {
+        fprintf(stderr, "Log file at %s has unsupported version %u\n", path,
+                h->version);
+        goto fail_map;
+    }
+    memcpy(&r->header, h,
+           h->header_size < sizeof(r->header) ? h->header_size
+                                              : sizeof(r->header));
+    // A log whose writer did not exit cleanly may be longer than the count
+    uint64_t space =
+        (r->map_size - r->header.header_size) / r->header.record_size;
+    r->nrecords = r->header.nrecords < space ? r->header.nrecords : space;
+    return 0;
+fail_map:
+    munmap((void *)r->map, r->map_size);
+fail:
+    close(r->fd);
+    return -1;
+}
+
+void log_reader_get(const struct log_reader *r, uint64_t i,
+                    struct log_record *out) {
+    const uint8_t *rec =
+        r->map + r->header.header_size + i * r->header.record_size;
+    size_t size = r->header.record_size < sizeof(*out) ? r->header.record_size
+                                                       : sizeof(*out);
+    memset(out, 0, sizeof(*out));
+    memcpy(out, rec, size);
+}
+
+void log_reader_close(struct log_reader *r) {
+    munmap((void *)r->map, r->map_size);
+    close(r->fd);
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Binary per-frame log, as written when LATENCYTOOL_LOG is set.
+ *
+ * The file is a `struct log_header` followed by `nrecords` fixed size
+ * `struct log_record` entries, all in host byte order. Readers should use
+ * `header_size` and `record_size` to locate records, so that fields can be
+ * appended to either structure in later versions. */
+
+#define LOG_MAGIC "LTCYLOG"
+#define LOG_VERSION 3
+
+// The camera level crossed the threshold on this frame
+#define LOG_FLAG_CAMERA_TRANSITION 0x1
+// The frame was already queued behind another when the backend got to it
+#define LOG_FLAG_BACKLOG 0x2
+
+// What frame capture times refer to
+#define LOG_TIMESTAMP_HOST 0 // when the program received the frame
+#define LOG_TIMESTAMP_START_OF_EXPOSURE 1 // from the driver
+#define LOG_TIMESTAMP_END_OF_FRAME 2      // from the driver
+
+struct log_header {
+    char magic[8]; // LOG_MAGIC, zero padded
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t record_size;
+    int32_t camera;
+    double threshold; // nominal light/dark threshold, in [0,1]
+    double fps;       // nominal camera frame rate
+    int64_t setup_time_ns; // CLOCK_MONOTONIC time that record times are
+                           // relative to
+    uint64_t nrecords;     // kept up to date while writing
+    char label[32];        // free-form description, from LATENCYTOOL_LABEL
+    // Since version 2
+    uint32_t timestamp_source; // LOG_TIMESTAMP_*
+    uint32_t reserved;
+};
+
+// Size of the header as written by version 1
+#define LOG_HEADER_V1_SIZE offsetof(struct log_header, timestamp_source)
+
+struct log_record {
+    int64_t time_ns;   // frame capture time
+    int64_t switch_ns; // when the display switch was issued, if any
+    float level;       // camera brightness, in [0,1]
+    int8_t display_transition; // 1 = switch to dark, -1 = to light, 0 = none
+    uint8_t flags;             // LOG_FLAG_*
+    uint16_t dropped; // frames lost by the camera just before this one
+    // Since version 3
+    float threshold; // light/dark threshold applied to this frame
+    uint32_t reserved;
+};
+
+// Size of a record as written by versions 1 and 2
+#define LOG_RECORD_V2_SIZE offsetof(struct log_record, threshold)
+
+struct log_writer {
+    int fd;
+    uint8_t *map;
+    size_t map_size;
+    struct log_header *header;
+};
+
+/* Create the file at `path`, and write a copy of `header` to it. */
+int log_writer_open(struct log_writer *w, const char *path,
+                    const struct log_header *header);
+int log_writer_append(struct log_writer *w, const struct log_record *r);
+void log_writer_close(struct log_writer *w);
+
+struct log_reader {
+    int fd;
+    const uint8_t *map;
+    size_t map_size;
+    struct log_header header; // fields absent from older versions are zero
+    uint64_t nrecords;
+};
+
+int log_reader_open(struct log_reader *r, const char *path);
+/* Copy record `i` to `out`; fields absent from older versions are zero */
+void log_reader_get(const struct log_reader *r, uint64_t i,
+                    struct log_record *out);
+void log_reader_close(struct log_reader *r);
+
+#ifdef __cplusplus
+}
+#endif
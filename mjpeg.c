@@ -0,0 +1,484 @@
+#include "mjpeg.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOOKUP_BITS 9
+#define MAX_COMPONENTS 4
+
+// Example Huffman tables from Annex K.3 of the JPEG standard
+static const uint8_t std_dc_luma_bits[16] = {0, 1, 5, 1, 1, 1, 1, 1,
+                                             1, 0, 0, 0, 0, 0, 0, 0};
+static const uint8_t std_dc_chroma_bits[16] = {0, 3, 1, 1, 1, 1, 1, 1,
+                                               1, 1, 1, 0, 0, 0, 0, 0};
+static const uint8_t std_dc_vals[12] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11};
+static const uint8_t std_ac_luma_bits[16] = {0, 2, 1, 3, 3, 2, 4, 3,
+                                             5, 5, 4, 4, 0, 0, 1, 0x7d};
+static const uint8_t std_ac_luma_vals[162] = {
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06,
+    0x13, 0x51, 0x61, 0x07, 0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08,
+    0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0, 0x24, 0x33, 0x62, 0x72,
+    0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45,
+    0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+    0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74, 0x75,
+    0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3,
+    0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6,
+    0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9,
+    0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+    0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4,
+    0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa};
+static const uint8_t std_ac_chroma_bits[16] = {0, 2, 1, 2, 4, 4, 3, 4,
+                                               7, 5, 4, 4, 0, 1, 2, 0x77};
+static const uint8_t std_ac_chroma_vals[162] = {
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41,
+    0x51, 0x07, 0x61, 0x71, 0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91,
+    0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0, 0x15, 0x62, 0x72, 0xd1,
+    0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+    0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44,
+    0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
+    0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74,
+    0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a,
+    0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4,
+    0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7,
+    0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+    0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4,
+    0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa};
+
+// Built once; frames without a DHT segment use these for tables 0 and 1
+static struct mjpeg_huffman std_dc[2], std_ac[2];
+static bool std_tables_built = false;
+
+static int build_huffman(struct mjpeg_huffman *h, const uint8_t *bits,
+                         const uint8_t *vals) {
+    int nsymbols = 0;
+    for (int i = 0; i < 16; i++) {
+        nsymbols += bits[i];
+    }
+    if (nsymbols > 256) {
+        return -1;
+    }
+    // Reject oversubscribed tables, as from damaged frames, before any
+    // code is written to the lookup tables
+    int32_t code = 0;
+    for (int len = 1; len <= 16; len++) {
+        code += bits[len - 1];
+        if (code > 1 << len) {
+            return -1;
+        }
+        code <<= 1;
+    }
+    memset(h, 0, sizeof(*h));
+    memcpy(h->symbols, vals, nsymbols);
+
+    // Canonical codes: consecutive within a length, doubled between them
+    code = 0;
+    int k = 0;
+    for (int len = 1; len <= 16; len++) {
+        h->valoffset[len] = k - code;
+        for (int i = 0; i < bits[len - 1]; i++, k++, code++) {
+            if (len <= LOOKUP_BITS) {
+                int shift = LOOKUP_BITS - len;
+                for (int j = 0; j < 1 << shift; j++) {
+                    h->lookup_len[(code << shift) | j] = len;
+                    h->lookup_sym[(code << shift) | j] = vals[k];
+                }
+            }
+        }
+        h->maxcode[len] = bits[len - 1] ? code - 1 : -1;
+        code <<= 1;
+    }
+    return 0;
+}
+
+int setup_mjpeg_decoder(struct mjpeg_decoder *d) {
+    memset(d, 0, sizeof(*d));
+    if (!std_tables_built) {
+        build_huffman(&std_dc[0], std_dc_luma_bits, std_dc_vals);
+        build_huffman(&std_dc[1], std_dc_chroma_bits, std_dc_vals);
+        build_huffman(&std_ac[0], std_ac_luma_bits, std_ac_luma_vals);
+        build_huffman(&std_ac[1], std_ac_chroma_bits, std_ac_chroma_vals);
+        std_tables_built = true;
+    }
+    return 0;
+}
+
+void cleanup_mjpeg_decoder(struct mjpeg_decoder *d) {
+    free(d->dc);
+    memset(d, 0, sizeof(*d));
+}
+
+/* Entropy coded data, with stuffed zero bytes removed. The next bits are
+ * the most significant ones of `acc`; past a marker, zeros are read. */
+struct bit_reader {
+    const uint8_t *p, *end;
+    uint64_t acc;
+    int nbits;
+    bool at_marker;
+};
+
+static void refill(struct bit_reader *b) {
+    while (b->nbits <= 56) {
+        uint8_t byte = 0;
+        if (!b->at_marker && b->p < b->end) {
+            byte = *b->p;
+            if (byte != 0xff) {
+                b->p++;
+            } else if (b->p + 1 < b->end && b->p[1] == 0x00) {
+                b->p += 2;
+            } else {
+                // Leave the marker for the caller
+                b->at_marker = true;
+                byte = 0;
+            }
+        }
+        b->acc |= (uint64_t)byte << (56 - b->nbits);
+        b->nbits += 8;
+    }
+}
+
+static inline void consume(struct bit_reader *b, int n) {
+    b->acc <<= n;
+    b->nbits -= n;
+}
+
+static inline int decode_symbol(struct bit_reader *b,
+                                const struct mjpeg_huffman *h) {
+    if (b->nbits < 16) {
+        refill(b);
+    }
+    int look = (int)(b->acc >> (64 - LOOKUP_BITS));
+    int len = h->lookup_len[look];
+    if (len) {
+        consume(b, len);
+        return h->lookup_sym[look];
+    }
+    for (len = LOOKUP_BITS + 1; len <= 16; len++) {
+        int32_t code = (int32_t)(b->acc >> (64 - len));
+        if (code <= h->maxcode[len]) {
+            consume(b, len);
+            return h->symbols[(code + h->valoffset[len]) & 0xff];
+        }
+    }
+    return -1;
+}
+
+/* Read an `s` bit coefficient, in the sign convention of the standard */
+static inline int receive_extend(struct bit_reader *b, int s) {
+    if (s == 0) {
+        return 0;
+    }
+    if (b->nbits < 16) {
+        refill(b);
+    }
+    int v = (int)(b->acc >> (64 - s));
+    consume(b, s);
+    return v < 1 << (s - 1) ? v - (1 << s) + 1 : v;
+}
+
+/* Skip the 63 AC coefficients of a block */
+static inline int skip_ac(struct bit_reader *b, const struct mjpeg_huffman *h) {
+    for (int k = 1; k < 64;) {
+        int rs = decode_symbol(b, h);
+        if (rs < 0) {
+            return -1;
+        }
+        int run = rs >> 4, size = rs & 15;
+        if (size == 0) {
+            if (run != 15) {
+                break; // end of block
+            }
+            k += 16;
+            continue;
+        }
+        if (b->nbits < 16) {
+            refill(b);
+        }
+        consume(b, size);
+        k += run + 1;
+    }
+    return 0;
+}
+
+struct component {
+    int id;
+    int h, v; // sampling factors
+    int tq;   // quantization table
+    const struct mjpeg_huffman *dc, *ac;
+    int pred; // last DC value
+};
+
+struct frame {
+    int width, height;
+    int ncomp;
+    struct component comps[MAX_COMPONENTS];
+    int hmax, vmax;
+    int restart_interval;
+    const struct mjpeg_huffman *dc_tables[4], *ac_tables[4];
+};
+
+static int store_dc_image(struct mjpeg_decoder *d, const struct frame *f) {
+    d->width = f->width;
+    d->height = f->height;
+    d->bw = (f->width + 7) / 8;
+    d->bh = (f->height + 7) / 8;
+    size_t size = (size_t)d->bw * d->bh;
+    if (size > d->dc_size) {
+        uint8_t *dc = realloc(d->dc, size);
+        if (!dc) {
+            fprintf(stderr, "Failed to allocate MJPEG block image\n");
+            return -1;
+        }
+        d->dc = dc;
+        d->dc_size = size;
+    }
+    return 0;
+}
+
+static int decode_scan(struct mjpeg_decoder *d, struct frame *f,
+                       struct component **scan, int ns, const uint8_t *p,
+                       const uint8_t *end, int max_row) {
+    if (store_dc_image(d, f) < 0) {
+        return -1;
+    }
+    // Only interleaved scans of every component, or grayscale frames
+    int mcu_w = 8 * f->hmax, mcu_h = 8 * f->vmax;
+    if (ns == 1) {
+        if (f->ncomp != 1) {
+            return -1;
+        }
+        mcu_w = mcu_h = 8;
+        scan[0]->h = scan[0]->v = 1;
+    } else if (ns != f->ncomp) {
+        return -1;
+    }
+    int mcux = (f->width + mcu_w - 1) / mcu_w;
+    int mcuy = (f->height + mcu_h - 1) / mcu_h;
+    if (max_row > 0) {
+        int rows = (max_row + mcu_h - 1) / mcu_h;
+        mcuy = rows < mcuy ? rows : mcuy;
+    }
+
+    const struct component *luma = &f->comps[0];
+    uint16_t q = d->dc_quant[luma->tq];
+    struct bit_reader b = {p, end, 0, 0, false};
+    int mcus = 0;
+    for (int my = 0; my < mcuy; my++) {
+        for (int mx = 0; mx < mcux; mx++) {
+            if (f->restart_interval && mcus &&
+                mcus % f->restart_interval == 0) {
+                // Skip the padding bits, and the RSTn marker
+                while (b.p + 1 < b.end &&
+                       !(b.p[0] == 0xff && (b.p[1] & 0xf8) == 0xd0)) {
+                    b.p++;
+                }
+                b.p += 2;
+                b.acc = 0;
+                b.nbits = 0;
+                b.at_marker = false;
+                for (int c = 0; c < ns; c++) {
+                    scan[c]->pred = 0;
+                }
+            }
+            for (int c = 0; c < ns; c++) {
+                struct component *comp = scan[c];
+                for (int by = 0; by < comp->v; by++) {
+                    for (int bx = 0; bx < comp->h; bx++) {
+                        int s = decode_symbol(&b, comp->dc);
+                        if (s < 0 || s > 11) {
+                            return -1;
+                        }
+                        comp->pred += receive_extend(&b, s);
+                        if (comp == luma) {
+                            int x = mx * comp->h + bx, y = my * comp->v + by;
+                            if (x < d->bw && y < d->bh) {
+                                // The DC coefficient is 8 times the mean
+                                int mean = 128 + (comp->pred * q + 4) / 8;
+                                mean = mean < 0 ? 0 : (mean > 255 ? 255 : mean);
+                                d->dc[y * d->bw + x] = (uint8_t)mean;
+                            }
+                        }
+                        if (skip_ac(&b, comp->ac) < 0) {
+                            return -1;
+                        }
+                    }
+                }
+            }
+            mcus++;
+        }
+    }
+    return 0;
+}
+
+static int parse_sof(struct frame *f, const uint8_t *seg,
+                     const uint8_t *segend) {
+    if (segend - seg < 6 || seg[0] != 8) {
+        return -1;
+    }
+    f->height = seg[1] << 8 | seg[2];
+    f->width = seg[3] << 8 | seg[4];
+    f->ncomp = seg[5];
+    if (f->ncomp < 1 || f->ncomp > MAX_COMPONENTS ||
+        segend - seg < 6 + 3 * f->ncomp || f->width == 0 || f->height == 0) {
+        return -1;
+    }
+    f->hmax = f->vmax = 1;
+    for (int i = 0; i < f->ncomp; i++) {
+        struct component *c = &f->comps[i];
+        c->id = seg[6 + 3 * i];
+        c->h = seg[7 + 3 * i] >> 4;
+        c->v = seg[7 + 3 * i] & 15;
+        c->tq = seg[8 + 3 * i] & 3;
+        if (c->h < 1 || c->h > 4 || c->v < 1 || c->v > 4) {
+            return -1;
+        }
+        f->hmax = c->h > f->hmax ? c->h : f->hmax;
+        f->vmax = c->v > f->vmax ? c->v : f->vmax;
+    }
+    return 0;
+}
+
+static int parse_dht(struct mjpeg_decoder *d, struct frame *f,
+                     const uint8_t *seg, const uint8_t *segend) {
+    while (seg < segend) {
+        if (segend - seg < 17) {
+            return -1;
+        }
+        int tc = seg[0] >> 4, th = seg[0] & 15;
+        if (tc > 1 || th > 3) {
+            return -1;
+        }
+        int n = 0;
+        for (int i = 0; i < 16; i++) {
+            n += seg[1 + i];
+        }
+        if (segend - seg < 17 + n) {
+            return -1;
+        }
+        struct mjpeg_huffman *h = tc ? &d->ac_tables[th] : &d->dc_tables[th];
+        if (build_huffman(h, seg + 1, seg + 17) < 0) {
+            return -1;
+        }
+        if (tc) {
+            f->ac_tables[th] = h;
+        } else {
+            f->dc_tables[th] = h;
+        }
+        seg += 17 + n;
+    }
+    return 0;
+}
+
+static int parse_dqt(struct mjpeg_decoder *d, const uint8_t *seg,
+                     const uint8_t *segend) {
+    while (seg < segend) {
+        int precision = seg[0] >> 4, tq = seg[0] & 15;
+        int size = precision ? 129 : 65;
+        if (precision > 1 || tq > 3 || segend - seg < size) {
+            return -1;
+        }
+        d->dc_quant[tq] = precision ? seg[1] << 8 | seg[2] : seg[1];
+        seg += size;
+    }
+    return 0;
+}
+
+int mjpeg_decode_dc(struct mjpeg_decoder *d, const uint8_t *data, size_t len,
+                    int max_row) {
+    const uint8_t *p = data, *end = data + len;
+    if (len < 4 || p[0] != 0xff || p[1] != 0xd8) {
+        return -1;
+    }
+    p += 2;
+
+    struct frame f;
+    memset(&f, 0, sizeof(f));
+    f.dc_tables[0] = &std_dc[0];
+    f.dc_tables[1] = &std_dc[1];
+    f.ac_tables[0] = &std_ac[0];
+    f.ac_tables[1] = &std_ac[1];
+    bool have_frame = false;
+
+    while (end - p >= 4) {
+        if (p[0] != 0xff) {
+            return -1;
+        }
+        uint8_t marker = p[1];
+        if (marker == 0xff) {
+            p++; // fill byte
+            continue;
+        }
+        p += 2;
+        int seglen = p[0] << 8 | p[1];
+        if (seglen < 2 || seglen > end - p) {
+            return -1;
+        }
+        const uint8_t *seg = p + 2, *segend = p + seglen;
+        p += seglen;
+
+        switch (marker) {
+        case 0xc0: // baseline
+        case 0xc1: // extended sequential, Huffman
+            if (parse_sof(&f, seg, segend) < 0) {
+                return -1;
+            }
+            have_frame = true;
+            break;
+        case 0xc4:
+            if (parse_dht(d, &f, seg, segend) < 0) {
+                return -1;
+            }
+            break;
+        case 0xdb:
+            if (parse_dqt(d, seg, segend) < 0) {
+                return -1;
+            }
+            break;
+        case 0xdd:
+            if (seglen < 4) {
+                return -1;
+            }
+            f.restart_interval = seg[0] << 8 | seg[1];
+            break;
+        case 0xda: {
+            if (!have_frame || seglen < 3) {
+                return -1;
+            }
+            int ns = seg[0];
+            if (ns < 1 || ns > f.ncomp || seglen < 6 + 2 * ns) {
+                return -1;
+            }
+            struct component *scan[MAX_COMPONENTS];
+            for (int i = 0; i < ns; i++) {
+                int id = seg[1 + 2 * i], tables = seg[2 + 2 * i];
+                scan[i] = NULL;
+                for (int c = 0; c < f.ncomp; c++) {
+                    if (f.comps[c].id == id) {
+                        scan[i] = &f.comps[c];
+                    }
+                }
+                if (!scan[i]) {
+                    return -1;
+                }
+                scan[i]->dc = f.dc_tables[tables >> 4 & 3];
+                scan[i]->ac = f.ac_tables[tables & 3];
+                scan[i]->pred = 0;
+                if (!scan[i]->dc || !scan[i]->ac) {
+                    return -1;
+                }
+            }
+            return decode_scan(d, &f, scan, ns, segend, end, max_row);
+        }
+        default:
+            if (marker >= 0xc2 && marker <= 0xcf) {
+                // Progressive, lossless, or arithmetic coded
+                return -1;
+            }
+            break; // APPn, COM, and others carry nothing needed
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Brightness of Motion-JPEG frames without decoding them. The DC
+ * coefficient of each 8x8 block is eight times the block's mean level
+ * (less 128), so entropy decoding the scan gives a 1/8 scale luma image;
+ * AC coefficients and chroma blocks are parsed only to skip over them, and
+ * no inverse DCT is done. Baseline Huffman frames, with one interleaved
+ * scan, are supported; frames without Huffman tables, as most UVC cameras
+ * send, use the example tables from the JPEG standard. */
+
+struct mjpeg_huffman {
+    // Codes of up to 9 bits are decoded with one lookup
+    uint8_t lookup_len[1 << 9];
+    uint8_t lookup_sym[1 << 9];
+    // For longer codes: the largest code of each length, and the index of
+    // the symbol for the smallest code of each length
+    int32_t maxcode[18];
+    int32_t valoffset[17];
+    uint8_t symbols[256];
+};
+
+struct mjpeg_decoder {
+    struct mjpeg_huffman dc_tables[4];
+    struct mjpeg_huffman ac_tables[4];
+    uint16_t dc_quant[4]; // first entry of each quantization table
+
+    // The luma image of the last frame, one sample per 8x8 block
+    int width, height; // of the frame, in pixels
+    int bw, bh;        // in blocks
+    uint8_t *dc;
+    size_t dc_size;
+};
+
+int setup_mjpeg_decoder(struct mjpeg_decoder *d);
+void cleanup_mjpeg_decoder(struct mjpeg_decoder *d);
+/* Decode the block means of the frame into `d->dc`, stopping after the
+ * blocks that cover pixel rows [0, max_row), if max_row > 0. Returns -1 if
+ * the frame is corrupt or unsupported. */
+int mjpeg_decode_dc(struct mjpeg_decoder *d, const uint8_t *data, size_t len,
+                    int max_row);
+
+#ifdef __cplusplus
+}
+#endif
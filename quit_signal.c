@@ -0,0 +1,26 @@
+#include "quit_signal.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+
+static volatile sig_atomic_t quit_signal = 0;
+
+static void note_quit(int signum) { quit_signal = signum; }
+
+void catch_quit_signals(void) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = note_quit;
+    sigemptyset(&sa.sa_mask);
+    // No SA_RESTART, so that a loop blocked in poll wakes up to see the flag
+    sa.sa_flags = SA_RESETHAND;
+    if (sigaction(SIGINT, &sa, NULL) < 0 ||
+        sigaction(SIGTERM, &sa, NULL) < 0) {
+        fprintf(stderr, "Failed to catch SIGINT and SIGTERM: %s\n",
+                strerror(errno));
+    }
+}
+
+bool quit_requested(void) { return quit_signal != 0; }
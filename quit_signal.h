@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Lets Ctrl+C and SIGTERM end a frontend's loop rather than the process, so
+ * that cleanup_backend still runs and hands the camera's controls back as
+ * they were found. Blocking calls in the loop return early with EINTR; a
+ * second signal terminates the process as usual. */
+
+void catch_quit_signals(void);
+/* Whether SIGINT or SIGTERM arrived since catch_quit_signals */
+bool quit_requested(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,217 @@
+#include "reduce.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
+static bool always(void) { return true; }
+
+static uint64_t sum_scalar(const uint8_t *data, size_t len) {
+    uint64_t total = 0;
+    for (size_t i = 0; i < len; i++) {
+        total += data[i];
+    }
+    return total;
+}
+
+static uint64_t sum_even_scalar(const uint8_t *data, size_t len) {
+    uint64_t total = 0;
+    for (size_t i = 0; i < len; i += 2) {
+        total += data[i];
+    }
+    return total;
+}
+
+#ifdef HAVE_X86_KERNELS
+
+/* Each kernel keeps four accumulators, to hide the latency of the adds,
+ * and leaves the last partial vectors to the scalar loop. Vectors start
+ * at even offsets, so masking the odd bytes of each 16-bit lane selects
+ * the even bytes of the frame. */
+
+static bool have_sse2(void) { return __builtin_cpu_supports("sse2"); }
+
+__attribute__((target("sse2"))) static uint64_t
+sad_sse2(const uint8_t *data, size_t len, bool even, size_t *done) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i mask = even ? _mm_set1_epi16(0x00ff) : _mm_set1_epi8(-1);
+    __m128i acc0 = zero, acc1 = zero, acc2 = zero, acc3 = zero;
+    const __m128i *p = (const __m128i *)data;
+    size_t n = len / 16, i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i v0 = _mm_and_si128(_mm_loadu_si128(p + i), mask);
+        __m128i v1 = _mm_and_si128(_mm_loadu_si128(p + i + 1), mask);
+        __m128i v2 = _mm_and_si128(_mm_loadu_si128(p + i + 2), mask);
+        __m128i v3 = _mm_and_si128(_mm_loadu_si128(p + i + 3), mask);
+        acc0 = _mm_add_epi64(acc0, _mm_sad_epu8(v0, zero));
+        acc1 = _mm_add_epi64(acc1, _mm_sad_epu8(v1, zero));
+        acc2 = _mm_add_epi64(acc2, _mm_sad_epu8(v2, zero));
+        acc3 = _mm_add_epi64(acc3, _mm_sad_epu8(v3, zero));
+    }
+    for (; i < n; i++) {
+        __m128i v = _mm_and_si128(_mm_loadu_si128(p + i), mask);
+        acc0 = _mm_add_epi64(acc0, _mm_sad_epu8(v, zero));
+    }
+    acc0 = _mm_add_epi64(_mm_add_epi64(acc0, acc1), _mm_add_epi64(acc2, acc3));
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i *)lanes, acc0);
+    *done = n * 16;
+    return lanes[0] + lanes[1];
+}
+
+static uint64_t sum_sse2(const uint8_t *data, size_t len) {
+    size_t done;
+    uint64_t total = sad_sse2(data, len, false, &done);
+    return total + sum_scalar(data + done, len - done);
+}
+
+static uint64_t sum_even_sse2(const uint8_t *data, size_t len) {
+    size_t done;
+    uint64_t total = sad_sse2(data, len, true, &done);
+    return total + sum_even_scalar(data + done, len - done);
+}
+
+static bool have_avx2(void) { return __builtin_cpu_supports("avx2"); }
+
+__attribute__((target("avx2"))) static uint64_t
+sad_avx2(const uint8_t *data, size_t len, bool even, size_t *done) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i mask =
+        even ? _mm256_set1_epi16(0x00ff) : _mm256_set1_epi8(-1);
+    __m256i acc0 = zero, acc1 = zero, acc2 = zero, acc3 = zero;
+    const __m256i *p = (const __m256i *)data;
+    size_t n = len / 32, i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i v0 = _mm256_and_si256(_mm256_loadu_si256(p + i), mask);
+        __m256i v1 = _mm256_and_si256(_mm256_loadu_si256(p + i + 1), mask);
+        __m256i v2 = _mm256_and_si256(_mm256_loadu_si256(p + i + 2), mask);
+        __m256i v3 = _mm256_and_si256(_mm256_loadu_si256(p + i + 3), mask);
+        acc0 = _mm256_add_epi64(acc0, _mm256_sad_epu8(v0, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_sad_epu8(v1, zero));
+        acc2 = _mm256_add_epi64(acc2, _mm256_sad_epu8(v2, zero));
+        acc3 = _mm256_add_epi64(acc3, _mm256_sad_epu8(v3, zero));
+    }
+    for (; i < n; i++) {
+        __m256i v = _mm256_and_si256(_mm256_loadu_si256(p + i), mask);
+        acc0 = _mm256_add_epi64(acc0, _mm256_sad_epu8(v, zero));
+    }
+    acc0 = _mm256_add_epi64(_mm256_add_epi64(acc0, acc1),
+                            _mm256_add_epi64(acc2, acc3));
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, acc0);
+    *done = n * 32;
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+static uint64_t sum_avx2(const uint8_t *data, size_t len) {
+    size_t done;
+    uint64_t total = sad_avx2(data, len, false, &done);
+    return total + sum_scalar(data + done, len - done);
+}
+
+static uint64_t sum_even_avx2(const uint8_t *data, size_t len) {
+    size_t done;
+    uint64_t total = sad_avx2(data, len, true, &done);
+    return total + sum_even_scalar(data + done, len - done);
+}
+
+static bool have_avx512bw(void) {
+    return __builtin_cpu_supports("avx512f") &&
+           __builtin_cpu_supports("avx512bw");
+}
+
+__attribute__((target("avx512f,avx512bw"))) static uint64_t
+sad_avx512bw(const uint8_t *data, size_t len, bool even, size_t *done) {
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i mask =
+        even ? _mm512_set1_epi16(0x00ff) : _mm512_set1_epi8(-1);
+    __m512i acc0 = zero, acc1 = zero, acc2 = zero, acc3 = zero;
+    const __m512i *p = (const __m512i *)data;
+    size_t n = len / 64, i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m512i v0 = _mm512_and_si512(_mm512_loadu_si512(p + i), mask);
+        __m512i v1 = _mm512_and_si512(_mm512_loadu_si512(p + i + 1), mask);
+        __m512i v2 = _mm512_and_si512(_mm512_loadu_si512(p + i + 2), mask);
+        __m512i v3 = _mm512_and_si512(_mm512_loadu_si512(p + i + 3), mask);
+        acc0 = _mm512_add_epi64(acc0, _mm512_sad_epu8(v0, zero));
+        acc1 = _mm512_add_epi64(acc1, _mm512_sad_epu8(v1, zero));
+        acc2 = _mm512_add_epi64(acc2, _mm512_sad_epu8(v2, zero));
+        acc3 = _mm512_add_epi64(acc3, _mm512_sad_epu8(v3, zero));
+    }
+    for (; i < n; i++) {
+        __m512i v = _mm512_and_si512(_mm512_loadu_si512(p + i), mask);
+        acc0 = _mm512_add_epi64(acc0, _mm512_sad_epu8(v, zero));
+    }
+    acc0 = _mm512_add_epi64(_mm512_add_epi64(acc0, acc1),
+                            _mm512_add_epi64(acc2, acc3));
+    *done = n * 64;
+    return _mm512_reduce_add_epi64(acc0);
+}
+
+static uint64_t sum_avx512bw(const uint8_t *data, size_t len) {
+    size_t done;
+    uint64_t total = sad_avx512bw(data, len, false, &done);
+    return total + sum_scalar(data + done, len - done);
+}
+
+static uint64_t sum_even_avx512bw(const uint8_t *data, size_t len) {
+    size_t done;
+    uint64_t total = sad_avx512bw(data, len, true, &done);
+    return total + sum_even_scalar(data + done, len - done);
+}
+
+#endif
+
+const struct reduce_kernel reduce_kernels[] = {
+    {"scalar", always, sum_scalar, sum_even_scalar},
+#ifdef HAVE_X86_KERNELS
+    {"sse2", have_sse2, sum_sse2, sum_even_sse2},
+    {"avx2", have_avx2, sum_avx2, sum_even_avx2},
+    {"avx512bw", have_avx512bw, sum_avx512bw, sum_even_avx512bw},
+#endif
+};
+const int reduce_nkernels = sizeof(reduce_kernels) / sizeof(reduce_kernels[0]);
+
+static const struct reduce_kernel *selected = NULL;
+
+const struct reduce_kernel *reduce_kernel(void) {
+    if (!selected) {
+        selected = &reduce_kernels[0];
+        for (int i = reduce_nkernels - 1; i > 0; i--) {
+            if (reduce_kernels[i].supported()) {
+                selected = &reduce_kernels[i];
+                break;
+            }
+        }
+    }
+    return selected;
+}
+
+int reduce_select(const char *name) {
+    for (int i = 0; i < reduce_nkernels; i++) {
+        if (!strcmp(reduce_kernels[i].name, name)) {
+            if (!reduce_kernels[i].supported()) {
+                fprintf(stderr, "Reduction kernel '%s' is not supported by "
+                                "this CPU\n",
+                        name);
+                return -1;
+            }
+            selected = &reduce_kernels[i];
+            return 0;
+        }
+    }
+    fprintf(stderr, "Unknown reduction kernel '%s'\n", name);
+    return -1;
+}
+
+uint64_t reduce_sum(const uint8_t *data, size_t len) {
+    return reduce_kernel()->sum(data, len);
+}
+
+uint64_t reduce_sum_even(const uint8_t *data, size_t len) {
+    return reduce_kernel()->sum_even(data, len);
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Byte sum kernels for frame brightness. Vectorized variants use the
+ * sum-of-absolute-differences instruction against zero, which adds groups
+ * of eight bytes into 64-bit lanes; the fastest variant the CPU supports is
+ * chosen on first use. */
+
+struct reduce_kernel {
+    const char *name;
+    bool (*supported)(void);
+    // Sum of the `len` bytes at `data`
+    uint64_t (*sum)(const uint8_t *data, size_t len);
+    // Sum of the bytes at even offsets, e.g. the luma of packed YUYV
+    uint64_t (*sum_even)(const uint8_t *data, size_t len);
+};
+
+// All variants, slowest first; the first is plain C and always supported
+extern const struct reduce_kernel reduce_kernels[];
+extern const int reduce_nkernels;
+
+/* The variant in use */
+const struct reduce_kernel *reduce_kernel(void);
+/* Use the named variant instead; fails if it is unknown or unsupported */
+int reduce_select(const char *name);
+
+uint64_t reduce_sum(const uint8_t *data, size_t len);
+uint64_t reduce_sum_even(const uint8_t *data, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,184 @@
+#include "reporter.h"
+#include "interface.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Must be a power of two. At 187 fps, this covers 20 seconds of stalls
+#define RING_SIZE 4096
+#define CACHELINE 64
+
+struct reporter {
+    // Producer and consumer positions, on separate cache lines
+    _Alignas(CACHELINE) atomic_uint_fast64_t head;
+    _Alignas(CACHELINE) atomic_uint_fast64_t tail;
+    _Alignas(CACHELINE) atomic_uint_fast64_t dropped;
+    atomic_bool stopping;
+
+    pthread_t thread;
+    bool logging;
+    struct log_writer log;
+    uint64_t dropped_reported;
+    char prefix[REPORT_PREFIX_LENGTH];
+
+    struct report_entry ring[RING_SIZE];
+};
+
+static void print_summary(const char *prefix, const struct delay_report *r) {
+    fprintf(stdout,
+            "%sNet: (%5.2f < %5.2f±%4.2f < %5.2f)ms L->D: (%5.2f±%4.2f)ms; "
+            "D->L: (%5.2f±%4.2f)ms\n",
+            prefix, r->net.min, r->net.mean, r->net.stdev, r->net.max,
+            r->ltd.mean, r->ltd.stdev, r->dtl.mean, r->dtl.stdev);
+    fprintf(stdout,
+            "%sPct: p50/p95/p99 Net: %5.2f/%5.2f/%5.2fms L->D: "
+            "%5.2f/%5.2f/%5.2fms D->L: %5.2f/%5.2f/%5.2fms\n",
+            prefix, r->net.p50, r->net.p95, r->net.p99, r->ltd.p50,
+            r->ltd.p95, r->ltd.p99, r->dtl.p50, r->dtl.p95, r->dtl.p99);
+    fflush(stdout);
+}
+
+static void print_capture(const char *prefix,
+                          const struct capture_report *c) {
+    fprintf(stdout, "%sHost: ", prefix);
+    // Without device timestamps, only the backlog is known
+    if (c->queue_delay.n > 0) {
+        fprintf(stdout,
+                "queue delay p50/p95/p99 %5.2f/%5.2f/%5.2fms max %5.2fms; "
+                "dropped %lu of %lu frames; ",
+                c->queue_delay.p50, c->queue_delay.p95, c->queue_delay.p99,
+                c->queue_delay.max, (unsigned long)c->dropped,
+                (unsigned long)(c->frames + c->dropped));
+    }
+    fprintf(stdout, "%lu frames waited behind newer ones\n",
+            (unsigned long)c->backlog);
+    fflush(stdout);
+}
+
+static void print_present(const char *prefix,
+                          const struct present_report *p) {
+    fprintf(stdout,
+            "%sDisplay: to scanout p50/p95/p99 %5.2f/%5.2f/%5.2fms; "
+            "scanout to camera p50/p95/p99 %5.2f/%5.2f/%5.2fms",
+            prefix, p->to_scanout.p50, p->to_scanout.p95, p->to_scanout.p99,
+            p->to_camera.p50, p->to_camera.p95, p->to_camera.p99);
+    if (p->refresh_ms > 0.) {
+        fprintf(stdout, "; refresh %5.2fms", p->refresh_ms);
+    }
+    fprintf(stdout, "; %s%s%s%s\n",
+            p->flags & PRESENT_VSYNC ? "vsync" : "no vsync",
+            p->flags & PRESENT_HW_CLOCK ? ", hw clock" : "",
+            p->flags & PRESENT_HW_COMPLETION ? ", hw completion" : "",
+            p->flags & PRESENT_ZERO_COPY ? ", zero copy" : "");
+    fflush(stdout);
+}
+
+static void check_dropped(struct reporter *r) {
+    uint64_t dropped = atomic_load_explicit(&r->dropped, memory_order_relaxed);
+    if (dropped != r->dropped_reported) {
+        fprintf(stderr, "Report queue overflowed: %lu entries dropped\n",
+                (unsigned long)dropped);
+        r->dropped_reported = dropped;
+    }
+}
+
+static void *writer_thread(void *data) {
+    struct reporter *r = (struct reporter *)data;
+    while (1) {
+        // Check before reading `head`, so nothing pushed before the stop
+        // request can be missed
+        bool stopping = atomic_load_explicit(&r->stopping, memory_order_acquire);
+        uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+        if (tail == head) {
+            check_dropped(r);
+            if (stopping) {
+                break;
+            }
+            // Output latency is unimportant; 1ms keeps the ring far from full
+            struct timespec pause = {0, 1000000};
+            nanosleep(&pause, NULL);
+            continue;
+        }
+
+        for (; tail != head; tail++) {
+            const struct report_entry *e = &r->ring[tail % RING_SIZE];
+            if (e->kind == REPORT_FRAME) {
+                if (r->logging) {
+                    log_writer_append(&r->log, &e->frame);
+                }
+            } else if (e->kind == REPORT_SUMMARY) {
+                print_summary(r->prefix, &e->summary);
+            } else if (e->kind == REPORT_CAPTURE) {
+                print_capture(r->prefix, &e->capture);
+            } else if (e->kind == REPORT_PRESENT) {
+                print_present(r->prefix, &e->present);
+            } else if (e->kind == REPORT_MESSAGE) {
+                fprintf(stderr, "%s%s\n", r->prefix, e->message);
+            }
+        }
+        atomic_store_explicit(&r->tail, tail, memory_order_release);
+    }
+    return NULL;
+}
+
+struct reporter *setup_reporter(const char *log_path,
+                                const struct log_header *header,
+                                const char *prefix) {
+    struct reporter *r = aligned_alloc(CACHELINE, sizeof(struct reporter));
+    if (!r) {
+        fprintf(stderr, "Failed to allocate report queue\n");
+        return NULL;
+    }
+    memset(r, 0, sizeof(*r));
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    atomic_init(&r->dropped, 0);
+    atomic_init(&r->stopping, false);
+    if (prefix) {
+        strncpy(r->prefix, prefix, sizeof(r->prefix) - 1);
+    }
+
+    if (log_path) {
+        if (log_writer_open(&r->log, log_path, header) < 0) {
+            free(r);
+            return NULL;
+        }
+        r->logging = true;
+    }
+
+    if (pthread_create(&r->thread, NULL, writer_thread, r) != 0) {
+        fprintf(stderr, "Failed to start writer thread\n");
+        if (r->logging) {
+            log_writer_close(&r->log);
+        }
+        free(r);
+        return NULL;
+    }
+    return r;
+}
+
+void cleanup_reporter(struct reporter *r) {
+    atomic_store_explicit(&r->stopping, true, memory_order_release);
+    pthread_join(r->thread, NULL);
+    if (r->logging) {
+        log_writer_close(&r->log);
+    }
+    free(r);
+}
+
+bool reporter_push(struct reporter *r, const struct report_entry *e) {
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    if (head - tail >= RING_SIZE) {
+        atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+        return false;
+    }
+    r->ring[head % RING_SIZE] = *e;
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+    return true;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "logfile.h"
+#include "stats.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Moves log writes and console output off the capture path. The capture
+ * thread pushes fixed-size entries into a lock-free single-producer,
+ * single-consumer ring, and a writer thread formats and stores them. When
+ * the ring is full, entries are dropped and counted instead of blocking. */
+
+enum report_kind {
+    REPORT_FRAME,
+    REPORT_SUMMARY,
+    REPORT_CAPTURE,
+    REPORT_PRESENT,
+    REPORT_MESSAGE
+};
+
+#define REPORT_MESSAGE_LENGTH 160
+#define REPORT_PREFIX_LENGTH 24
+
+struct capture_report {
+    struct delay_summary queue_delay; // device timestamp to dequeue, in ms
+    uint64_t frames;
+    uint64_t dropped;
+    uint64_t backlog; // frames that waited behind a newer one
+};
+
+struct present_report {
+    struct delay_summary to_scanout; // display switch to scanout, in ms
+    struct delay_summary to_camera;  // scanout to camera crossing, in ms
+    uint64_t presentations;
+    double refresh_ms; // 0 if unknown
+    uint32_t flags;    // PRESENT_*, of the latest presentation
+};
+
+struct report_entry {
+    enum report_kind kind;
+    union {
+        struct log_record frame;
+        struct delay_report summary;
+        struct capture_report capture;
+        struct present_report present;
+        char message[REPORT_MESSAGE_LENGTH]; // printed to stderr
+    };
+};
+
+struct reporter;
+
+/* If `log_path` is not NULL, frame entries are written there, to a binary
+ * log with the given header. If `prefix` is not NULL, it starts every line
+ * printed, to tell several analyses apart. */
+struct reporter *setup_reporter(const char *log_path,
+                                const struct log_header *header,
+                                const char *prefix);
+/* Flushes all queued entries, then stops the writer thread */
+void cleanup_reporter(struct reporter *r);
+/* Never blocks; returns false if the entry was dropped */
+bool reporter_push(struct reporter *r, const struct report_entry *e);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,169 @@
+#include "roi.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Blocks must follow the frame level at least this closely...
+#define ROI_MIN_CORRELATION 0.8
+// ...and vary by at least this fraction of the strongest block's amount,
+// which excludes blocks that only catch the display's glow
+#define ROI_MIN_AMPLITUDE 0.25
+// Frames needed before correlations mean anything
+#define ROI_MIN_FRAMES 8
+
+int parse_roi(const char *str, bool *automatic, struct roi *roi) {
+    int x, y, w, h;
+    char extra;
+    if (!strcmp(str, "auto")) {
+        *automatic = true;
+        return 0;
+    }
+    if (sscanf(str, "%d,%d,%d,%d%c", &x, &y, &w, &h, &extra) != 4 || x < 0 ||
+        y < 0 || w < 1 || h < 1) {
+        fprintf(stderr, "Invalid LATENCYTOOL_ROI '%s', must be 'auto' or "
+                        "'x,y,width,height'\n",
+                str);
+        return -1;
+    }
+    *automatic = false;
+    roi->x0 = x;
+    roi->y0 = y;
+    roi->x1 = x + w;
+    roi->y1 = y + h;
+    return 0;
+}
+
+int setup_roi_finder(struct roi_finder *f, int width, int height,
+                     int block) {
+    memset(f, 0, sizeof(*f));
+    f->width = width;
+    f->height = height;
+    f->block = block;
+    f->nx = (width + block - 1) / block;
+    f->ny = (height + block - 1) / block;
+    int n = f->nx * f->ny;
+    f->block_means = calloc(n, sizeof(double));
+    f->sum_b = calloc(n, sizeof(double));
+    f->sum_bb = calloc(n, sizeof(double));
+    f->sum_bl = calloc(n, sizeof(double));
+    if (!f->block_means || !f->sum_b || !f->sum_bb || !f->sum_bl) {
+        fprintf(stderr, "Failed to allocate region of interest search\n");
+        cleanup_roi_finder(f);
+        return -1;
+    }
+    return 0;
+}
+
+void cleanup_roi_finder(struct roi_finder *f) {
+    free(f->block_means);
+    free(f->sum_b);
+    free(f->sum_bb);
+    free(f->sum_bl);
+    memset(f, 0, sizeof(*f));
+}
+
+void roi_finder_add(struct roi_finder *f, const uint8_t *data, int stride,
+                    int step, double level) {
+    int n = f->nx * f->ny;
+    memset(f->block_means, 0, n * sizeof(double));
+    for (int y = 0; y < f->height; y++) {
+        const uint8_t *row = data + (size_t)y * stride;
+        double *means = f->block_means + (y / f->block) * f->nx;
+        for (int bx = 0; bx < f->nx; bx++) {
+            int end = (bx + 1) * f->block;
+            end = end < f->width ? end : f->width;
+            uint32_t sum = 0;
+            for (int x = bx * f->block; x < end; x++) {
+                sum += row[x * step];
+            }
+            means[bx] += sum;
+        }
+    }
+    for (int by = 0; by < f->ny; by++) {
+        int h = f->height - by * f->block;
+        h = h < f->block ? h : f->block;
+        for (int bx = 0; bx < f->nx; bx++) {
+            int w = f->width - bx * f->block;
+            w = w < f->block ? w : f->block;
+            int i = by * f->nx + bx;
+            double b = f->block_means[i] / (w * h * 255.);
+            f->sum_b[i] += b;
+            f->sum_bb[i] += b * b;
+            f->sum_bl[i] += b * level;
+        }
+    }
+    f->sum_l += level;
+    f->sum_ll += level * level;
+    f->nframes++;
+}
+
+bool roi_finder_result(const struct roi_finder *f, struct roi *roi) {
+    if (f->nframes < ROI_MIN_FRAMES) {
+        return false;
+    }
+    int n = f->nx * f->ny;
+    double mean_l = f->sum_l / f->nframes;
+    double var_l = f->sum_ll / f->nframes - mean_l * mean_l;
+    if (var_l <= 0.) {
+        return false;
+    }
+
+    // Reuse the scratch space for the standard deviation of kept blocks
+    double *amp = f->block_means;
+    double max_amp = 0.;
+    for (int i = 0; i < n; i++) {
+        double mean_b = f->sum_b[i] / f->nframes;
+        double var_b = f->sum_bb[i] / f->nframes - mean_b * mean_b;
+        double cov = f->sum_bl[i] / f->nframes - mean_b * mean_l;
+        amp[i] = 0.;
+        if (var_b > 0. && cov / sqrt(var_b * var_l) >= ROI_MIN_CORRELATION) {
+            amp[i] = sqrt(var_b);
+            max_amp = amp[i] > max_amp ? amp[i] : max_amp;
+        }
+    }
+    if (max_amp <= 0.) {
+        return false;
+    }
+
+    int kept = 0;
+    for (int i = 0; i < n; i++) {
+        if (amp[i] < ROI_MIN_AMPLITUDE * max_amp) {
+            amp[i] = 0.;
+        } else {
+            kept++;
+        }
+    }
+    // Isolated blocks are reflections or noise, unless nothing else is left
+    int bx0 = f->nx, by0 = f->ny, bx1 = -1, by1 = -1;
+    for (int by = 0; by < f->ny; by++) {
+        for (int bx = 0; bx < f->nx; bx++) {
+            int i = by * f->nx + bx;
+            if (amp[i] <= 0.) {
+                continue;
+            }
+            bool neighbor = (bx > 0 && amp[i - 1] > 0.) ||
+                            (bx < f->nx - 1 && amp[i + 1] > 0.) ||
+                            (by > 0 && amp[i - f->nx] > 0.) ||
+                            (by < f->ny - 1 && amp[i + f->nx] > 0.);
+            if (!neighbor && kept > 1) {
+                continue;
+            }
+            bx0 = bx < bx0 ? bx : bx0;
+            by0 = by < by0 ? by : by0;
+            bx1 = bx > bx1 ? bx : bx1;
+            by1 = by > by1 ? by : by1;
+        }
+    }
+    if (bx1 < 0) {
+        return false;
+    }
+    roi->x0 = bx0 * f->block;
+    roi->y0 = by0 * f->block;
+    roi->x1 = (bx1 + 1) * f->block < f->width ? (bx1 + 1) * f->block
+                                                 : f->width;
+    roi->y1 = (by1 + 1) * f->block < f->height ? (by1 + 1) * f->block
+                                                  : f->height;
+    return true;
+}
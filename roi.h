@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Finds the part of the camera image that shows the display. While the
+ * display flickers, the frame is split into square blocks, and the blocks
+ * whose mean brightness follows the whole-frame level are kept; the region
+ * of interest is the bounding box of the kept blocks. */
+
+// Block size for full resolution images, in pixels
+#define ROI_BLOCK 16
+
+// Pixel rectangle [x0,x1) x [y0,y1)
+struct roi {
+    int x0, y0, x1, y1;
+};
+
+struct roi_finder {
+    int width, height;   // in pixels
+    int block;           // block size, in pixels
+    int nx, ny;          // blocks across and down
+    double *block_means; // per-frame block sums, scratch for the result
+    // Sums over frames of the block means b and the frame level l
+    double *sum_b, *sum_bb, *sum_bl;
+    double sum_l, sum_ll;
+    int nframes;
+};
+
+/* Parse LATENCYTOOL_ROI: "auto", or "x,y,width,height" in pixels */
+int parse_roi(const char *str, bool *automatic, struct roi *roi);
+
+int setup_roi_finder(struct roi_finder *f, int width, int height, int block);
+void cleanup_roi_finder(struct roi_finder *f);
+/* Add a frame with one brightness byte per pixel, `step` bytes apart, with
+ * rows `stride` bytes apart, and its whole-frame level */
+void roi_finder_add(struct roi_finder *f, const uint8_t *data, int stride,
+                    int step, double level);
+/* Returns false if no part of the image follows the flicker */
+bool roi_finder_result(const struct roi_finder *f, struct roi *roi);
+
+#ifdef __cplusplus
+}
+#endif
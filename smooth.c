@@ -0,0 +1,111 @@
+#include "smooth.h"
+
+#include <math.h>
+#include <string.h>
+
+// Frames accepted unconditionally while the fit settles
+#define WARMUP_FRAMES 16
+// Residuals beyond this many standard deviations are outliers...
+#define OUTLIER_SIGMAS 4.
+// ...but differences below this fraction of a frame period never are
+#define MIN_GATE_PERIODS 0.1
+// After this many outliers in a row, the fit is assumed stale and restarted
+#define MAX_REJECTED_RUN 8
+
+void setup_timestamp_filter(struct timestamp_filter *f, double fps,
+                            double memory) {
+    memset(f, 0, sizeof(*f));
+    f->period = fps > 0. ? 1. / fps : 1. / 30.;
+    double frames = memory / f->period;
+    f->decay = frames > 2. ? 1. - 1. / frames : 0.5;
+}
+
+static void restart(struct timestamp_filter *f, int64_t seq,
+                    int64_t time_ns) {
+    f->started = true;
+    f->ref_ns = time_ns;
+    f->ref_seq = seq;
+    f->sw = 1.;
+    f->sx = f->sy = f->sxx = f->sxy = 0.;
+    f->rejected_run = 0;
+}
+
+/* Fit y = a + b x, where x = 0 is the last sample */
+static bool fit(const struct timestamp_filter *f, double *a, double *b) {
+    double det = f->sw * f->sxx - f->sx * f->sx;
+    if (f->sw < 2. || det <= 1e-9 * f->sw * f->sw) {
+        return false;
+    }
+    *b = (f->sw * f->sxy - f->sx * f->sy) / det;
+    *a = (f->sy - *b * f->sx) / f->sw;
+    return true;
+}
+
+/* Move the origin of the sums to (dx, dy). Keeping it at the most recent
+ * sample avoids the cancellation that ever growing sequence numbers and
+ * times would cause. */
+static void rebase(struct timestamp_filter *f, double dx, double dy) {
+    f->sxy += dx * dy * f->sw - dy * f->sx - dx * f->sy;
+    f->sxx += dx * dx * f->sw - 2. * dx * f->sx;
+    f->sx -= dx * f->sw;
+    f->sy -= dy * f->sw;
+}
+
+int64_t timestamp_filter_update(struct timestamp_filter *f, int64_t sequence,
+                                int64_t time_ns) {
+    f->nframes++;
+    int64_t seq = sequence + f->seq_shift;
+    if (!f->started) {
+        restart(f, seq, time_ns);
+        return time_ns;
+    }
+
+    double dx = (double)(seq - f->ref_seq);
+    double dy = (time_ns - f->ref_ns) * 1e-9;
+    double a, b;
+    if (fit(f, &a, &b) && b > 0.) {
+        double resid = dy - (a + b * dx);
+        double gate = OUTLIER_SIGMAS * sqrt(f->resid_var);
+        if (gate < MIN_GATE_PERIODS * b) {
+            gate = MIN_GATE_PERIODS * b;
+        }
+        if (f->nframes > WARMUP_FRAMES && fabs(resid) > gate) {
+            double shift = round(resid / b);
+            if (shift != 0. && fabs(resid - shift * b) <= gate) {
+                // Off by whole frames: some were dropped or repeated
+                f->seq_shift += (int64_t)shift;
+                seq += (int64_t)shift;
+                dx += shift;
+                resid -= shift * b;
+                f->renumbered++;
+            } else {
+                f->rejected++;
+                if (++f->rejected_run > MAX_REJECTED_RUN) {
+                    restart(f, seq, time_ns);
+                    return time_ns;
+                }
+                // Keep the fit, and use the time it expects for the frame
+                return f->ref_ns + (int64_t)((a + b * dx) * 1e9);
+            }
+        }
+        f->rejected_run = 0;
+        f->resid_var =
+            f->decay * f->resid_var + (1. - f->decay) * resid * resid;
+    }
+
+    // Age the sums, and add the new sample as the origin
+    f->sw *= f->decay;
+    f->sx *= f->decay;
+    f->sy *= f->decay;
+    f->sxx *= f->decay;
+    f->sxy *= f->decay;
+    rebase(f, dx, dy);
+    f->sw += 1.;
+    f->ref_seq = seq;
+    f->ref_ns = time_ns;
+
+    if (!fit(f, &a, &b)) {
+        return time_ns;
+    }
+    return time_ns + (int64_t)(a * 1e9);
+}
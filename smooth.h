@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Regularizes frame timestamps. Capture times are fit as a linear function
+ * of the frame sequence number, by exponentially weighted least squares, so
+ * that USB and scheduling jitter is averaged out and slow drift between the
+ * camera and host clocks is followed. Frames far off the fit are either
+ * renumbered, when they are off by a whole number of frame periods (dropped
+ * or repeated frames), or replaced by the prediction. */
+
+struct timestamp_filter {
+    double decay;     // weight of the past per frame, in (0,1)
+    double period;    // nominal frame period, in seconds
+    bool started;
+    int64_t ref_ns;   // time of the last sample, which is the origin
+    int64_t ref_seq;  // its corrected sequence number
+    int64_t seq_shift; // correction added to incoming sequence numbers
+
+    // Weighted sums over samples (x = sequence, y = seconds), relative to
+    // the last sample
+    double sw, sx, sy, sxx, sxy;
+    double resid_var; // weighted mean squared residual of accepted frames
+    int rejected_run; // consecutive frames replaced by the prediction
+
+    uint64_t nframes;
+    uint64_t renumbered;
+    uint64_t rejected;
+};
+
+/* `fps` is the nominal frame rate; `memory` is the time constant of the
+ * exponential weighting, in seconds */
+void setup_timestamp_filter(struct timestamp_filter *f, double fps,
+                            double memory);
+/* Returns the regularized time, in ns, of the frame numbered `sequence`
+ * that was captured at `time_ns` */
+int64_t timestamp_filter_update(struct timestamp_filter *f, int64_t sequence,
+                                int64_t time_ns);
+
+#ifdef __cplusplus
+}
+#endif
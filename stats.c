@@ -0,0 +1,219 @@
+#include "stats.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Welford's update, run forwards to add and backwards to remove a sample.
+ * Unlike raw power sums, this does not lose precision over long runs. */
+static void moments_add(struct moments *m, double x) {
+    m->n += 1.;
+    double d = x - m->mean;
+    m->mean += d / m->n;
+    m->m2 += d * (x - m->mean);
+}
+
+static void moments_remove(struct moments *m, double x) {
+    if (m->n <= 1.) {
+        memset(m, 0, sizeof(*m));
+        return;
+    }
+    double d = x - m->mean;
+    m->mean -= d / (m->n - 1.);
+    m->m2 -= d * (x - m->mean);
+    m->n -= 1.;
+    if (m->m2 < 0.) {
+        m->m2 = 0.;
+    }
+}
+
+static int delay_bin(double delay_ms) {
+    double b = floor(delay_ms / QUANTILE_RESOLUTION_MS);
+    if (b < 0.) {
+        return 0;
+    }
+    return b >= QUANTILE_BINS ? QUANTILE_BINS - 1 : (int)b;
+}
+
+static void rank_update(int32_t *tree, double delay_ms, int32_t change) {
+    for (int i = delay_bin(delay_ms) + 1; i <= QUANTILE_BINS; i += i & -i) {
+        tree[i] += change;
+    }
+}
+
+/* Returns the value of the k'th smallest sample (1-based), by descending
+ * the Fenwick tree for the first bin whose prefix count reaches k. */
+static double rank_select(const int32_t *tree, int32_t k) {
+    int pos = 0;
+    for (int step = QUANTILE_BINS; step > 0; step >>= 1) {
+        if (pos + step <= QUANTILE_BINS && tree[pos + step] < k) {
+            pos += step;
+            k -= tree[pos];
+        }
+    }
+    return (pos + 0.5) * QUANTILE_RESOLUTION_MS;
+}
+
+static double rank_quantile(const int32_t *tree, double n, double q) {
+    if (n < 1.) {
+        return -1.;
+    }
+    int32_t k = (int32_t)ceil(q * n);
+    k = k < 1 ? 1 : (k > (int32_t)n ? (int32_t)n : k);
+    return rank_select(tree, k);
+}
+
+static void moments_summary(const struct moments *m, const int32_t *ranks,
+                            struct delay_summary *out) {
+    out->n = m->n;
+    out->mean = m->n > 0. ? m->mean : -1.;
+    out->stdev = m->n > 2. ? sqrt(m->m2 / (m->n - 1.)) : -1.;
+    out->p50 = rank_quantile(ranks, m->n, 0.50);
+    out->p95 = rank_quantile(ranks, m->n, 0.95);
+    out->p99 = rank_quantile(ranks, m->n, 0.99);
+}
+
+int setup_delay_stats(struct delay_stats *s, int window) {
+    memset(s, 0, sizeof(*s));
+    s->window = window;
+    s->ring = calloc(window, sizeof(double));
+    s->ring_to_dark = calloc(window, sizeof(bool));
+    s->min_q = calloc(window, sizeof(uint64_t));
+    s->max_q = calloc(window, sizeof(uint64_t));
+    s->rank_net = calloc(QUANTILE_BINS + 1, sizeof(int32_t));
+    s->rank_ltd = calloc(QUANTILE_BINS + 1, sizeof(int32_t));
+    s->rank_dtl = calloc(QUANTILE_BINS + 1, sizeof(int32_t));
+    if (!s->ring || !s->ring_to_dark || !s->min_q || !s->max_q ||
+        !s->rank_net || !s->rank_ltd || !s->rank_dtl) {
+        fprintf(stderr, "Failed to allocate statistics window of length %d\n",
+                window);
+        cleanup_delay_stats(s);
+        return -1;
+    }
+    return 0;
+}
+
+void cleanup_delay_stats(struct delay_stats *s) {
+    free(s->ring);
+    free(s->ring_to_dark);
+    free(s->min_q);
+    free(s->max_q);
+    free(s->rank_net);
+    free(s->rank_ltd);
+    free(s->rank_dtl);
+    s->ring = NULL;
+    s->ring_to_dark = NULL;
+    s->min_q = NULL;
+    s->max_q = NULL;
+    s->rank_net = NULL;
+    s->rank_ltd = NULL;
+    s->rank_dtl = NULL;
+}
+
+static double sample(const struct delay_stats *s, uint64_t seq) {
+    return s->ring[seq % s->window];
+}
+
+/* Push `seq` onto a monotonic deque, first dropping the entries that can
+ * never again be the window extremum. */
+static void deque_push(const struct delay_stats *s, uint64_t *q, int *head,
+                       int *len, uint64_t seq, bool is_max) {
+    double v = sample(s, seq);
+    while (*len > 0) {
+        uint64_t back = q[(*head + *len - 1) % s->window];
+        double bv = sample(s, back);
+        if (is_max ? bv > v : bv < v) {
+            break;
+        }
+        (*len)--;
+    }
+    q[(*head + *len) % s->window] = seq;
+    (*len)++;
+}
+
+static void deque_evict(const struct delay_stats *s, uint64_t *q, int *head,
+                        int *len, uint64_t seq) {
+    if (*len > 0 && q[*head] == seq) {
+        *head = (*head + 1) % s->window;
+        (*len)--;
+    }
+}
+
+void delay_stats_add(struct delay_stats *s, double delay_ms, bool to_dark) {
+    uint64_t seq = s->count;
+    int idx = seq % s->window;
+    if (seq >= (uint64_t)s->window) {
+        // Evict the oldest sample, whose slot is about to be reused
+        double old = s->ring[idx];
+        moments_remove(&s->net, old);
+        moments_remove(s->ring_to_dark[idx] ? &s->ltd : &s->dtl, old);
+        rank_update(s->rank_net, old, -1);
+        rank_update(s->ring_to_dark[idx] ? s->rank_ltd : s->rank_dtl, old,
+                    -1);
+        deque_evict(s, s->min_q, &s->min_head, &s->min_len,
+                    seq - s->window);
+        deque_evict(s, s->max_q, &s->max_head, &s->max_len,
+                    seq - s->window);
+    }
+
+    s->ring[idx] = delay_ms;
+    s->ring_to_dark[idx] = to_dark;
+    s->count++;
+    moments_add(&s->net, delay_ms);
+    moments_add(to_dark ? &s->ltd : &s->dtl, delay_ms);
+    moments_add(&s->total_net, delay_ms);
+    moments_add(to_dark ? &s->total_ltd : &s->total_dtl, delay_ms);
+    rank_update(s->rank_net, delay_ms, 1);
+    rank_update(to_dark ? s->rank_ltd : s->rank_dtl, delay_ms, 1);
+    deque_push(s, s->min_q, &s->min_head, &s->min_len, seq, false);
+    deque_push(s, s->max_q, &s->max_head, &s->max_len, seq, true);
+}
+
+void delay_stats_report(const struct delay_stats *s, struct delay_report *r) {
+    moments_summary(&s->net, s->rank_net, &r->net);
+    moments_summary(&s->ltd, s->rank_ltd, &r->ltd);
+    moments_summary(&s->dtl, s->rank_dtl, &r->dtl);
+    if (s->min_len > 0) {
+        r->net.min = sample(s, s->min_q[s->min_head]);
+        r->net.max = sample(s, s->max_q[s->max_head]);
+    } else {
+        r->net.min = -1.;
+        r->net.max = -1.;
+    }
+    // Per-direction extrema are not tracked
+    r->ltd.min = r->ltd.max = -1.;
+    r->dtl.min = r->dtl.max = -1.;
+}
+
+/* Two-sided 97.5% quantile of Student's t distribution, from the
+ * Cornish-Fisher expansion around the normal quantile; within 0.5% of the
+ * exact value for df >= 5. */
+static double t_quantile_975(double df) {
+    const double z = 1.959964;
+    double z3 = z * z * z, z5 = z3 * z * z;
+    return z + (z3 + z) / (4. * df) +
+           (5. * z5 + 16. * z3 + 3. * z) / (96. * df * df);
+}
+
+// Below this, the expansion (and the normality assumption) are unreliable
+#define MIN_INTERVAL_SAMPLES 6
+
+static void moments_interval(const struct moments *m,
+                             struct delay_interval *out) {
+    out->n = m->n;
+    out->mean = m->n > 0. ? m->mean : -1.;
+    if (m->n < MIN_INTERVAL_SAMPLES) {
+        out->half_width = INFINITY;
+        return;
+    }
+    double stdev = sqrt(m->m2 / (m->n - 1.));
+    out->half_width = t_quantile_975(m->n - 1.) * stdev / sqrt(m->n);
+}
+
+void delay_stats_confidence(const struct delay_stats *s,
+                            struct delay_confidence *c) {
+    moments_interval(&s->total_net, &c->net);
+    moments_interval(&s->total_ltd, &c->ltd);
+    moments_interval(&s->total_dtl, &c->dtl);
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Sliding window statistics over the most recent transition delays.
+ * Adding a sample (and evicting the oldest one, once the window is full)
+ * takes constant amortized time for the moments and extrema, and
+ * logarithmic time for the percentile histograms. */
+
+// Percentiles are computed from histograms with this bin width, covering
+// [0, QUANTILE_BINS * QUANTILE_RESOLUTION_MS); other delays are clamped.
+#define QUANTILE_RESOLUTION_MS 0.01
+#define QUANTILE_BINS (1 << 17)
+
+#define MAX_STATS_WINDOW 10000000
+
+struct moments {
+    double n;
+    double mean;
+    double m2; // sum of squared deviations from the mean
+};
+
+struct delay_summary {
+    double n;
+    double mean;
+    double stdev;
+    double min;
+    double max;
+    double p50;
+    double p95;
+    double p99;
+};
+
+struct delay_report {
+    struct delay_summary net; // both directions
+    struct delay_summary ltd; // light to dark
+    struct delay_summary dtl; // dark to light
+};
+
+// Confidence interval for the mean delay, over all samples ever added
+struct delay_interval {
+    double n;
+    double mean;
+    double half_width; // of the 95% interval; infinite with too few samples
+};
+
+struct delay_confidence {
+    struct delay_interval net, ltd, dtl;
+};
+
+struct delay_stats {
+    int window;
+    uint64_t count; // total samples ever added
+
+    // Ring of the last `window` samples, in ms, and their directions
+    double *ring;
+    bool *ring_to_dark;
+
+    struct moments net, ltd, dtl;
+    // Over all samples, for confidence intervals
+    struct moments total_net, total_ltd, total_dtl;
+
+    // Monotonic deques of sample sequence numbers for the sliding min/max
+    // of the delay. Each is stored as a ring of capacity `window`.
+    uint64_t *min_q, *max_q;
+    int min_head, min_len;
+    int max_head, max_len;
+
+    // Fenwick trees over histogram bins, for order statistics
+    int32_t *rank_net, *rank_ltd, *rank_dtl;
+};
+
+int setup_delay_stats(struct delay_stats *s, int window);
+void cleanup_delay_stats(struct delay_stats *s);
+/* Add one transition delay, in milliseconds */
+void delay_stats_add(struct delay_stats *s, double delay_ms, bool to_dark);
+void delay_stats_report(const struct delay_stats *s, struct delay_report *r);
+/* Student t intervals, treating the delays as independent samples */
+void delay_stats_confidence(const struct delay_stats *s,
+                            struct delay_confidence *c);
+
+#ifdef __cplusplus
+}
+#endif
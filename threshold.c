@@ -0,0 +1,113 @@
+#include "threshold.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Recomputing every few frames is plenty; the window spans seconds
+#define UPDATE_INTERVAL 16
+// Accept a threshold only when most of the level variance is explained by
+// the light/dark split, and neither class is rare
+#define MIN_SEPARATION 0.6
+#define MIN_CLASS_FRACTION 0.1
+
+int setup_threshold_tracker(struct threshold_tracker *t, int window,
+                            double initial) {
+    memset(t, 0, sizeof(*t));
+    t->ring = calloc(window, sizeof(uint8_t));
+    if (!t->ring) {
+        fprintf(stderr, "Failed to allocate threshold histogram\n");
+        return -1;
+    }
+    t->window = window;
+    t->threshold = initial;
+    return 0;
+}
+
+void cleanup_threshold_tracker(struct threshold_tracker *t) {
+    free(t->ring);
+    t->ring = NULL;
+}
+
+void reset_threshold_tracker(struct threshold_tracker *t) {
+    memset(t->hist, 0, sizeof(t->hist));
+    t->nframes = 0;
+    t->since_update = 0;
+    t->confident = false;
+    t->separation = 0.;
+    t->low_mean = 0.;
+    t->high_mean = 0.;
+}
+
+static void otsu(struct threshold_tracker *t) {
+    double total = 0., sum = 0.;
+    for (int i = 0; i < LEVEL_BINS; i++) {
+        total += t->hist[i];
+        sum += i * (double)t->hist[i];
+    }
+    if (total < 2.) {
+        return;
+    }
+    double mean = sum / total;
+    double var = 0.;
+    for (int i = 0; i < LEVEL_BINS; i++) {
+        var += t->hist[i] * (i - mean) * (i - mean);
+    }
+    var /= total;
+
+    double best = -1., w0 = 0., sum0 = 0.;
+    int best_k = 0;
+    double best_w0 = 0., best_m0 = 0., best_m1 = 0.;
+    for (int k = 0; k < LEVEL_BINS - 1; k++) {
+        w0 += t->hist[k];
+        sum0 += k * (double)t->hist[k];
+        double w1 = total - w0;
+        if (w0 == 0. || w1 == 0.) {
+            continue;
+        }
+        double m0 = sum0 / w0, m1 = (sum - sum0) / w1;
+        double between = w0 * w1 * (m0 - m1) * (m0 - m1);
+        if (between > best) {
+            best = between;
+            best_k = k;
+            best_w0 = w0;
+            best_m0 = m0;
+            best_m1 = m1;
+        }
+    }
+    if (best < 0. || var <= 0.) {
+        t->confident = false;
+        return;
+    }
+    t->separation = best / (total * total) / var;
+    // Bin centres
+    t->low_mean = (best_m0 + 0.5) / LEVEL_BINS;
+    t->high_mean = (best_m1 + 0.5) / LEVEL_BINS;
+    double frac = best_w0 / total;
+    t->confident = t->separation >= MIN_SEPARATION &&
+                   frac >= MIN_CLASS_FRACTION &&
+                   frac <= 1. - MIN_CLASS_FRACTION;
+    if (t->confident) {
+        // Boundary between bin best_k and the one above it
+        t->threshold = (best_k + 1) / (double)LEVEL_BINS;
+    }
+}
+
+double threshold_tracker_add(struct threshold_tracker *t, double level) {
+    int bin = (int)(level * LEVEL_BINS);
+    bin = bin < 0 ? 0 : (bin >= LEVEL_BINS ? LEVEL_BINS - 1 : bin);
+
+    int idx = t->nframes % t->window;
+    if (t->nframes >= (uint64_t)t->window) {
+        t->hist[t->ring[idx]]--;
+    }
+    t->ring[idx] = bin;
+    t->hist[bin]++;
+    t->nframes++;
+
+    if (++t->since_update >= UPDATE_INTERVAL) {
+        t->since_update = 0;
+        otsu(t);
+    }
+    return t->threshold;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Chooses the light/dark threshold from a histogram of the brightness of
+ * recent frames, with Otsu's method: the chosen level maximizes the
+ * variance between the frames below and above it. */
+
+#define LEVEL_BINS 256
+
+struct threshold_tracker {
+    int window; // frames in the histogram
+    uint8_t *ring;
+    uint64_t nframes;
+    uint32_t hist[LEVEL_BINS];
+    int since_update;
+
+    bool confident; // is the histogram clearly bimodal?
+    double threshold;
+    double separation; // between-class / total variance, in [0,1]
+    double low_mean, high_mean; // of the levels on either side, in [0,1]
+};
+
+int setup_threshold_tracker(struct threshold_tracker *t, int window,
+                            double initial);
+void cleanup_threshold_tracker(struct threshold_tracker *t);
+/* Forget all frames, keeping the current threshold until confident again */
+void reset_threshold_tracker(struct threshold_tracker *t);
+/* Add a frame's level, in [0,1]; returns the current threshold */
+double threshold_tracker_add(struct threshold_tracker *t, double level);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,131 @@
+#include "reduce.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Frame sizes for one byte per pixel; packed YUYV doubles them
+static const int sizes[][2] = {
+    {320, 240}, {640, 480}, {1280, 720}, {1920, 1080}};
+#define NSIZES (int)(sizeof(sizes) / sizeof(sizes[0]))
+
+// Each measurement runs for at least this long
+#define MIN_BENCH_TIME 0.2
+// Checked exhaustively, from every start offset, to cover the scalar
+// heads and tails of the vector kernels
+#define MAX_CHECK_LEN 300
+#define MAX_CHECK_OFFSET 64
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/* Returns seconds per call */
+static double bench(uint64_t (*fn)(const uint8_t *, size_t),
+                    const uint8_t *data, size_t len, uint64_t *result) {
+    // Warm the cache and branch predictors
+    *result = fn(data, len);
+    int reps = 1;
+    while (1) {
+        double start = now();
+        volatile uint64_t sink = 0;
+        for (int r = 0; r < reps; r++) {
+            sink += fn(data, len);
+        }
+        double elapsed = now() - start;
+        (void)sink;
+        if (elapsed >= MIN_BENCH_TIME) {
+            return elapsed / reps;
+        }
+        reps *= 2;
+    }
+}
+
+/* Compare every supported kernel with the first, scalar one, on short
+ * buffers of any length and alignment and on one frame-sized odd length */
+static bool check_kernels(const uint8_t *data, size_t max_len) {
+    bool ok = true;
+    for (int k = 1; k < reduce_nkernels; k++) {
+        const struct reduce_kernel *ref = &reduce_kernels[0];
+        const struct reduce_kernel *kern = &reduce_kernels[k];
+        if (!kern->supported()) {
+            continue;
+        }
+        int failures = 0;
+        for (size_t off = 0; off < MAX_CHECK_OFFSET; off++) {
+            for (size_t len = 0; len <= MAX_CHECK_LEN; len++) {
+                const uint8_t *d = data + off;
+                if (kern->sum(d, len) != ref->sum(d, len) ||
+                    kern->sum_even(d, len) != ref->sum_even(d, len)) {
+                    failures++;
+                }
+            }
+        }
+        size_t len = max_len - MAX_CHECK_OFFSET - 1;
+        const uint8_t *d = data + 1;
+        if (kern->sum(d, len) != ref->sum(d, len) ||
+            kern->sum_even(d, len) != ref->sum_even(d, len)) {
+            failures++;
+        }
+        fprintf(stdout, "Checked %-9s against %s: %s\n", kern->name,
+                ref->name, failures ? "MISMATCH" : "ok");
+        ok = ok && !failures;
+    }
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 1) {
+        fprintf(stderr, "Usage: %s\n", argv[0]);
+        fprintf(stderr, "Time the frame brightness reduction kernels on "
+                        "frames of common sizes\n");
+        return EXIT_FAILURE;
+    }
+    fprintf(stdout, "Default kernel: %s\n", reduce_kernel()->name);
+
+    size_t max_len = (size_t)sizes[NSIZES - 1][0] * sizes[NSIZES - 1][1];
+    uint8_t *data = malloc(max_len);
+    if (!data) {
+        fprintf(stderr, "Failed to allocate frame\n");
+        return EXIT_FAILURE;
+    }
+    srand(1);
+    for (size_t i = 0; i < max_len; i++) {
+        data[i] = rand() & 0xff;
+    }
+
+    int ret = check_kernels(data, max_len) ? EXIT_SUCCESS : EXIT_FAILURE;
+    for (int s = 0; s < NSIZES; s++) {
+        size_t len = (size_t)sizes[s][0] * sizes[s][1];
+        uint64_t expect_sum = 0, expect_even = 0;
+        for (int k = 0; k < reduce_nkernels; k++) {
+            const struct reduce_kernel *kern = &reduce_kernels[k];
+            if (!kern->supported()) {
+                fprintf(stdout, "%4dx%-4d %-9s unsupported\n", sizes[s][0],
+                        sizes[s][1], kern->name);
+                continue;
+            }
+            uint64_t sum, even;
+            double t_sum = bench(kern->sum, data, len, &sum);
+            double t_even = bench(kern->sum_even, data, len, &even);
+            if (k == 0) {
+                expect_sum = sum;
+                expect_even = even;
+            }
+            bool ok = sum == expect_sum && even == expect_even;
+            fprintf(stdout,
+                    "%4dx%-4d %-9s sum %8.2fus %6.2fGB/s  even %8.2fus "
+                    "%6.2fGB/s%s\n",
+                    sizes[s][0], sizes[s][1], kern->name, t_sum * 1e6,
+                    len / t_sum * 1e-9, t_even * 1e6, len / t_even * 1e-9,
+                    ok ? "" : "  MISMATCH");
+            if (!ok) {
+                ret = EXIT_FAILURE;
+            }
+        }
+    }
+    free(data);
+    return ret;
+}
@@ -0,0 +1,54 @@
+#include "logfile.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+int main(int argc, char **argv) {
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "Usage: latency_log2text log_file [output_file]\n");
+        fprintf(stderr, "Convert a binary LATENCYTOOL_LOG recording to text\n");
+        fprintf(stderr, "\n");
+        fprintf(stderr, "Each output line has the frame time in seconds since "
+                        "setup, the camera level,\n");
+        fprintf(stderr, "and the display transition (1 = to dark, -1 = to "
+                        "light, 0 = none).\n");
+        return EXIT_FAILURE;
+    }
+
+    struct log_reader r;
+    if (log_reader_open(&r, argv[1]) < 0) {
+        return EXIT_FAILURE;
+    }
+    FILE *out = stdout;
+    if (argc == 3) {
+        out = fopen(argv[2], "w");
+        if (!out) {
+            fprintf(stderr, "Failed to open output file %s\n", argv[2]);
+            log_reader_close(&r);
+            return EXIT_FAILURE;
+        }
+    }
+
+    static const char *sources[] = {"host", "start-of-exposure",
+                                     "end-of-frame"};
+    uint32_t source = r.header.timestamp_source;
+    fprintf(stderr,
+            "version=%u camera=%d threshold=%.3f fps=%.2f records=%lu "
+            "timestamps=%s label='%.*s'\n",
+            r.header.version, r.header.camera, r.header.threshold,
+            r.header.fps, (unsigned long)r.nrecords,
+            source < 3 ? sources[source] : "unknown",
+            (int)sizeof(r.header.label), r.header.label);
+    for (uint64_t i = 0; i < r.nrecords; i++) {
+        struct log_record rec;
+        log_reader_get(&r, i, &rec);
+        fprintf(out, "%.9f %.3f %d\n", rec.time_ns * 1e-9, rec.level,
+                rec.display_transition);
+    }
+
+    if (out != stdout) {
+        fclose(out);
+    }
+    log_reader_close(&r);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,399 @@
+#include "interface.h"
+#include "logfile.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_VALUES 256
+
+struct recording {
+    struct log_record *frames;
+    size_t nframes;
+    int camera;
+    double fps;
+    double threshold;
+    int timestamp_source;
+    bool frame_thresholds; // each record holds the threshold applied to it
+};
+
+struct job {
+    double threshold; // or 0 to use each frame's recorded threshold
+    enum Interpolation interp;
+    int window;
+
+    int ntransitions;
+    struct delay_report result;
+};
+
+struct sweep {
+    const struct recording *rec;
+    struct job *jobs;
+    int njobs;
+    atomic_int next_job;
+};
+
+static int load_binary(const char *path, struct recording *rec) {
+    struct log_reader r;
+    if (log_reader_open(&r, path) < 0) {
+        return -1;
+    }
+    rec->nframes = r.nrecords;
+    rec->frames = calloc(rec->nframes ? rec->nframes : 1,
+                         sizeof(struct log_record));
+    if (!rec->frames) {
+        log_reader_close(&r);
+        return -1;
+    }
+    for (size_t i = 0; i < rec->nframes; i++) {
+        log_reader_get(&r, i, &rec->frames[i]);
+    }
+    rec->camera = r.header.camera;
+    rec->fps = r.header.fps;
+    rec->threshold = r.header.threshold;
+    rec->timestamp_source = r.header.timestamp_source;
+    rec->frame_thresholds = r.header.version >= 3;
+    log_reader_close(&r);
+    return 0;
+}
+
+/* Text logs, as written by earlier versions or latency_log2text, do not
+ * record when display switches were scheduled; the frame time on which they
+ * were made is used instead, which slightly underestimates delays. */
+static int load_text(FILE *f, struct recording *rec) {
+    size_t space = 1 << 16;
+    rec->frames = calloc(space, sizeof(struct log_record));
+    if (!rec->frames) {
+        return -1;
+    }
+    rec->nframes = 0;
+    rec->camera = -1;
+    rec->fps = 0.;
+    rec->threshold = 0.3;
+    rec->timestamp_source = LOG_TIMESTAMP_HOST;
+    rec->frame_thresholds = false;
+    double t;
+    float level;
+    int transition;
+    while (fscanf(f, "%lf %f %d", &t, &level, &transition) == 3) {
+        if (rec->nframes == space) {
+            space *= 2;
+            struct log_record *more =
+                realloc(rec->frames, space * sizeof(struct log_record));
+            if (!more) {
+                return -1;
+            }
+            rec->frames = more;
+        }
+        struct log_record *r = &rec->frames[rec->nframes++];
+        memset(r, 0, sizeof(*r));
+        r->time_ns = (int64_t)(t * 1e9);
+        r->switch_ns = r->time_ns;
+        r->level = level;
+        r->display_transition = transition;
+    }
+    return 0;
+}
+
+static int load_recording(const char *path, struct recording *rec) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Failed to open %s\n", path);
+        return -1;
+    }
+    char magic[sizeof(LOG_MAGIC)];
+    bool binary = fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+                  !memcmp(magic, LOG_MAGIC, sizeof(magic));
+    int ret;
+    if (binary) {
+        fclose(f);
+        ret = load_binary(path, rec);
+    } else {
+        rewind(f);
+        ret = load_text(f, rec);
+        fclose(f);
+    }
+    return ret;
+}
+
+static struct timespec ns_to_timespec(int64_t ns) {
+    struct timespec t;
+    t.tv_sec = ns / 1000000000;
+    t.tv_nsec = ns % 1000000000;
+    return t;
+}
+
+static void run_job(const struct recording *rec, struct job *job) {
+    struct analysis_options opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.window = job->window;
+    opts.interp = job->interp;
+    opts.quiet = true;
+    opts.passive = true;
+    double nominal = job->threshold > 0. ? job->threshold : rec->threshold;
+    struct capture_info info = {.camera = rec->camera,
+                                .fps = rec->fps,
+                                .threshold = nominal,
+                                .timestamp_source = rec->timestamp_source};
+
+    struct analysis a;
+    if (setup_analysis_opts(&a, &info, &opts) < 0) {
+        job->ntransitions = -1;
+        return;
+    }
+    for (size_t i = 0; i < rec->nframes; i++) {
+        const struct log_record *r = &rec->frames[i];
+        double threshold = job->threshold > 0. ? job->threshold : r->threshold;
+        update_analysis(&a, ns_to_timespec(r->time_ns), r->level, threshold);
+        // The display switch was requested after processing the frame
+        if (r->display_transition) {
+            analysis_external_switch(&a, ns_to_timespec(r->switch_ns),
+                                     r->display_transition > 0);
+        }
+    }
+    job->ntransitions = a.ntransitions;
+    delay_stats_report(&a.stats, &job->result);
+    cleanup_analysis(&a);
+}
+
+/* "recorded" when each frame's own threshold was used */
+static const char *threshold_name(double threshold, char *buf, size_t size) {
+    if (threshold <= 0.) {
+        return "recorded";
+    }
+    snprintf(buf, size, "%.3f", threshold);
+    return buf;
+}
+
+static void *sweep_thread(void *data) {
+    struct sweep *sw = (struct sweep *)data;
+    while (1) {
+        int i = atomic_fetch_add(&sw->next_job, 1);
+        if (i >= sw->njobs) {
+            break;
+        }
+        run_job(sw->rec, &sw->jobs[i]);
+    }
+    return NULL;
+}
+
+/* Parse "a,b,c" or "start:stop:step" */
+static int parse_values(const char *str, double *out) {
+    double start, stop, step;
+    char extra;
+    if (sscanf(str, "%lf:%lf:%lf%c", &start, &stop, &step, &extra) == 3) {
+        if (step <= 0. || stop < start) {
+            return -1;
+        }
+        int n = 0;
+        for (double v = start; v <= stop + step * 1e-6; v += step) {
+            if (n == MAX_VALUES) {
+                fprintf(stderr, "At most %d values are allowed\n", MAX_VALUES);
+                return -1;
+            }
+            out[n++] = v;
+        }
+        return n;
+    }
+    int n = 0;
+    const char *p = str;
+    while (*p) {
+        if (n == MAX_VALUES) {
+            fprintf(stderr, "At most %d values are allowed\n", MAX_VALUES);
+            return -1;
+        }
+        char *end;
+        out[n++] = strtod(p, &end);
+        if (end == p || (*end && *end != ',')) {
+            return -1;
+        }
+        p = *end ? end + 1 : end;
+    }
+    return n;
+}
+
+static int parse_interps(const char *str, enum Interpolation *out) {
+    int n = 0;
+    char *copy = strdup(str);
+    if (!copy) {
+        return -1;
+    }
+    for (char *tok = strtok(copy, ","); tok; tok = strtok(NULL, ",")) {
+        if (n == MAX_VALUES) {
+            fprintf(stderr, "At most %d values are allowed\n", MAX_VALUES);
+            free(copy);
+            return -1;
+        }
+        if (parse_interpolation(tok, &out[n]) < 0) {
+            fprintf(stderr, "Unknown interpolation method '%s'\n", tok);
+            free(copy);
+            return -1;
+        }
+        n++;
+    }
+    free(copy);
+    return n;
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: latency_replay [options] log_file\n");
+    fprintf(stderr, "Rerun the analysis on a LATENCYTOOL_LOG recording, "
+                    "sweeping over parameters\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Options (lists are 'a,b,c' or 'start:stop:step'):\n");
+    fprintf(stderr, "  -t thresholds  Light/dark thresholds (default: the "
+                    "recorded ones)\n");
+    fprintf(stderr, "  -i methods     Interpolation methods: "
+                    "none,linear,step,sigmoid (default: all)\n");
+    fprintf(stderr, "  -w windows     Statistics window lengths (default: "
+                    "whole recording)\n");
+    fprintf(stderr, "  -j threads     Worker threads (default: all cores)\n");
+}
+
+int main(int argc, char **argv) {
+    double thresholds[MAX_VALUES], windows[MAX_VALUES];
+    enum Interpolation interps[MAX_VALUES];
+    int nthresholds = 0, nwindows = 0, ninterps = 0;
+    int nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:i:w:j:h")) != -1) {
+        switch (opt) {
+        case 't':
+            nthresholds = parse_values(optarg, thresholds);
+            break;
+        case 'i':
+            ninterps = parse_interps(optarg, interps);
+            break;
+        case 'w':
+            nwindows = parse_values(optarg, windows);
+            break;
+        case 'j':
+            nthreads = atoi(optarg);
+            break;
+        default:
+            usage();
+            return EXIT_FAILURE;
+        }
+        if (nthresholds < 0 || ninterps < 0 || nwindows < 0 || nthreads < 1) {
+            fprintf(stderr, "Invalid argument for -%c: '%s'\n", opt, optarg);
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind != argc - 1) {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    struct recording rec;
+    if (load_recording(argv[optind], &rec) < 0) {
+        return EXIT_FAILURE;
+    }
+    fprintf(stderr, "Loaded %zu frames; camera=%d fps=%.2f threshold=%.3f\n",
+            rec.nframes, rec.camera, rec.fps, rec.threshold);
+
+    if (nthresholds == 0) {
+        // Runs with LATENCYTOOL_THRESHOLD=auto changed it frame by frame
+        thresholds[nthresholds++] = rec.frame_thresholds ? 0. : rec.threshold;
+    }
+    if (ninterps == 0) {
+        for (int i = 0; i < NumInterpolations; i++) {
+            interps[ninterps++] = (enum Interpolation)i;
+        }
+    }
+    // There are at most two transitions per frame pair
+    int max_window = rec.nframes / 2 + 1;
+    if (max_window > MAX_STATS_WINDOW) {
+        max_window = MAX_STATS_WINDOW;
+    }
+    if (nwindows == 0) {
+        windows[nwindows++] = max_window;
+    }
+
+    struct sweep sw;
+    sw.rec = &rec;
+    sw.njobs = nthresholds * ninterps * nwindows;
+    sw.jobs = calloc(sw.njobs, sizeof(struct job));
+    if (!sw.jobs) {
+        fprintf(stderr, "Failed to allocate %d jobs\n", sw.njobs);
+        free(rec.frames);
+        return EXIT_FAILURE;
+    }
+    atomic_init(&sw.next_job, 0);
+    int k = 0;
+    for (int i = 0; i < nthresholds; i++) {
+        for (int j = 0; j < ninterps; j++) {
+            for (int w = 0; w < nwindows; w++) {
+                sw.jobs[k].threshold = thresholds[i];
+                sw.jobs[k].interp = interps[j];
+                sw.jobs[k].window =
+                    windows[w] < 1 ? 1
+                                   : (windows[w] > max_window ? max_window
+                                                              : windows[w]);
+                k++;
+            }
+        }
+    }
+
+    if (nthreads > sw.njobs) {
+        nthreads = sw.njobs;
+    }
+    pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+    int started = 0;
+    while (threads && started < nthreads) {
+        int err = pthread_create(&threads[started], NULL, sweep_thread, &sw);
+        if (err) {
+            fprintf(stderr, "Failed to start worker thread: %s\n",
+                    strerror(err));
+            break;
+        }
+        started++;
+    }
+    // Whichever workers started take all jobs; without any, run them here
+    if (started == 0) {
+        sweep_thread(&sw);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    int best = -1;
+    char name[16];
+    for (int i = 0; i < sw.njobs; i++) {
+        const struct job *job = &sw.jobs[i];
+        const struct delay_report *r = &job->result;
+        const char *threshold =
+            threshold_name(job->threshold, name, sizeof(name));
+        if (job->ntransitions < 0) {
+            fprintf(stdout, "threshold=%s interp=%s window=%d: failed\n",
+                    threshold, interpolation_name(job->interp), job->window);
+            continue;
+        }
+        fprintf(stdout,
+                "threshold=%-8s interp=%-6s window=%-7d transitions=%-6d "
+                "Net: %5.2f±%4.2f p50/p95/p99 %5.2f/%5.2f/%5.2f L->D: "
+                "%5.2f±%4.2f D->L: %5.2f±%4.2f ms\n",
+                threshold, interpolation_name(job->interp), job->window,
+                job->ntransitions, r->net.mean, r->net.stdev, r->net.p50,
+                r->net.p95, r->net.p99, r->ltd.mean, r->ltd.stdev, r->dtl.mean,
+                r->dtl.stdev);
+        if (r->net.stdev > 0. &&
+            (best < 0 || r->net.stdev < sw.jobs[best].result.net.stdev)) {
+            best = i;
+        }
+    }
+    if (best >= 0) {
+        fprintf(stdout, "Lowest deviation: threshold=%s interp=%s window=%d\n",
+                threshold_name(sw.jobs[best].threshold, name, sizeof(name)),
+                interpolation_name(sw.jobs[best].interp),
+                sw.jobs[best].window);
+    }
+
+    free(threads);
+    free(sw.jobs);
+    free(rec.frames);
+    return EXIT_SUCCESS;
+}
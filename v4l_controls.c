@@ -0,0 +1,292 @@
+#include "v4l_controls.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+
+// Frames taken within this long after a change may use the old exposure
+#define EXPOSURE_SETTLE_TIME 0.1
+// Longest an exposure is tried before it is judged too short
+#define EXPOSURE_TEST_TIME 1.5
+// The threshold tracker only re-evaluates its histogram every 16 frames
+#define EXPOSURE_MIN_TEST_FRAMES 32
+// Light and dark frames must differ by this much of the full level range
+#define EXPOSURE_MIN_CONTRAST 0.1
+// The search ends once the shortest success is within this factor of the
+// longest failure
+#define EXPOSURE_RESOLUTION 1.25
+
+// Turned off unless LATENCYTOOL_EXPOSURE=auto, if the camera has them
+static const struct {
+    uint32_t id;
+    int32_t value;
+} manual_settings[] = {
+    {V4L2_CID_EXPOSURE_AUTO, V4L2_EXPOSURE_MANUAL},
+    // Otherwise the camera may lower its frame rate to expose for longer
+    {V4L2_CID_EXPOSURE_AUTO_PRIORITY, 0},
+    {V4L2_CID_AUTOGAIN, 0},
+    {V4L2_CID_AUTO_WHITE_BALANCE, 0},
+};
+#define NUM_MANUAL_SETTINGS                                                    \
+    (int)(sizeof(manual_settings) / sizeof(manual_settings[0]))
+
+int ioctl_loop(int fd, unsigned long int req, void *arg) {
+    // In case frontend has weird signal settings, check for EINTR
+    while (1) {
+        int r = ioctl(fd, req, arg);
+        if (r == -1 && errno == EINTR) {
+            continue;
+        }
+        return r;
+    }
+}
+
+/* Whether the control exists and can be written now */
+static bool query_control(int fd, uint32_t id, struct v4l2_queryctrl *q) {
+    memset(q, 0, sizeof(*q));
+    q->id = id;
+    if (ioctl_loop(fd, VIDIOC_QUERYCTRL, q) < 0) {
+        return false;
+    }
+    return !(q->flags & (V4L2_CTRL_FLAG_DISABLED | V4L2_CTRL_FLAG_READ_ONLY |
+                         V4L2_CTRL_FLAG_GRABBED));
+}
+
+static int set_control(int fd, const struct v4l2_queryctrl *q,
+                       int32_t value) {
+    struct v4l2_control ctrl = {q->id, value};
+    if (ioctl_loop(fd, VIDIOC_S_CTRL, &ctrl) < 0) {
+        fprintf(stderr, "Failed to set '%.32s' to %d: %s\n", q->name, value,
+                strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void list_controls(int fd) {
+    struct v4l2_queryctrl q;
+    memset(&q, 0, sizeof(q));
+    q.id = V4L2_CTRL_FLAG_NEXT_CTRL;
+    fprintf(stderr, "Camera controls:\n");
+    while (ioctl_loop(fd, VIDIOC_QUERYCTRL, &q) == 0) {
+        struct v4l2_control ctrl = {q.id, 0};
+        bool scalar = q.type == V4L2_CTRL_TYPE_INTEGER ||
+                      q.type == V4L2_CTRL_TYPE_BOOLEAN ||
+                      q.type == V4L2_CTRL_TYPE_MENU;
+        if (q.flags & V4L2_CTRL_FLAG_DISABLED ||
+            q.type == V4L2_CTRL_TYPE_CTRL_CLASS) {
+            // Nothing to show
+        } else if (scalar && ioctl_loop(fd, VIDIOC_G_CTRL, &ctrl) == 0) {
+            fprintf(stderr, "  %-32.32s %6d (%d to %d)%s\n", q.name,
+                    ctrl.value, q.minimum, q.maximum,
+                    q.flags & V4L2_CTRL_FLAG_INACTIVE ? " inactive" : "");
+        } else {
+            fprintf(stderr, "  %.32s\n", q.name);
+        }
+        q.id |= V4L2_CTRL_FLAG_NEXT_CTRL;
+    }
+}
+
+/* Remember a control's value before it is first changed */
+static void save_control(struct v4l_controls *c, uint32_t id) {
+    for (int i = 0; i < c->nsaved; i++) {
+        if (c->saved[i].id == id) {
+            return;
+        }
+    }
+    struct v4l2_control ctrl = {id, 0};
+    if (c->nsaved < MAX_SAVED_CONTROLS &&
+        ioctl_loop(c->fd, VIDIOC_G_CTRL, &ctrl) == 0) {
+        c->saved[c->nsaved++] = ctrl;
+    }
+}
+
+static void disable_automatic_controls(struct v4l_controls *c) {
+    for (int i = 0; i < NUM_MANUAL_SETTINGS; i++) {
+        struct v4l2_queryctrl q;
+        if (!query_control(c->fd, manual_settings[i].id, &q)) {
+            continue;
+        }
+        save_control(c, q.id);
+        if (set_control(c->fd, &q, manual_settings[i].value) == 0) {
+            fprintf(stderr, "Set '%.32s' to %d\n", q.name,
+                    manual_settings[i].value);
+        }
+    }
+}
+
+/* The nearest value the control accepts */
+static int32_t round_exposure(const struct v4l_controls *c, double value) {
+    const struct v4l2_queryctrl *q = &c->exposure;
+    int32_t step = q->step > 0 ? q->step : 1;
+    double steps = round((value - q->minimum) / step);
+    int64_t v = q->minimum + (int64_t)steps * step;
+    return v < q->minimum ? q->minimum : (v > q->maximum ? q->maximum : v);
+}
+
+static void try_exposure(struct v4l_controls *c, int32_t value) {
+    c->trying = value;
+    c->nframes = 0;
+    reset_threshold_tracker(&c->tracker);
+    set_control(c->fd, &c->exposure, value);
+}
+
+int setup_v4l_controls(struct v4l_controls *c, int fd, double fps,
+                       int queued, double threshold) {
+    memset(c, 0, sizeof(*c));
+    c->fd = fd;
+    char *expstr = getenv("LATENCYTOOL_EXPOSURE");
+    if (expstr && !strcmp(expstr, "auto")) {
+        return 0;
+    }
+    list_controls(fd);
+    disable_automatic_controls(c);
+
+    // Queried after automatic exposure is off, which may enable these
+    c->have_exposure =
+        query_control(fd, V4L2_CID_EXPOSURE_ABSOLUTE, &c->exposure) ||
+        query_control(fd, V4L2_CID_EXPOSURE, &c->exposure);
+    if (c->have_exposure) {
+        struct v4l2_control ctrl = {c->exposure.id, 0};
+        if (ioctl_loop(fd, VIDIOC_G_CTRL, &ctrl) < 0) {
+            ctrl.value = c->exposure.default_value;
+        }
+        c->initial_exposure = ctrl.value;
+    }
+    if (!expstr) {
+        return 0;
+    }
+    if (!c->have_exposure) {
+        fprintf(stderr, "Camera has no manual exposure control\n");
+        return -1;
+    }
+    save_control(c, c->exposure.id);
+
+    if (strcmp(expstr, "search") != 0) {
+        char *end;
+        long value = strtol(expstr, &end, 10);
+        if (end == expstr || *end || value < c->exposure.minimum ||
+            value > c->exposure.maximum) {
+            fprintf(stderr,
+                    "Invalid LATENCYTOOL_EXPOSURE '%s', must be 'auto', "
+                    "'search', or %d to %d\n",
+                    expstr, c->exposure.minimum, c->exposure.maximum);
+            return -1;
+        }
+        if (set_control(fd, &c->exposure, (int32_t)value) < 0) {
+            return -1;
+        }
+        fprintf(stderr, "Set '%.32s' to %ld\n", c->exposure.name, value);
+        return 0;
+    }
+
+    if (fps <= 1.) {
+        fps = 30.;
+    }
+    c->settle_frames = queued + (int)ceil(EXPOSURE_SETTLE_TIME * fps);
+    c->test_frames = (int)(EXPOSURE_TEST_TIME * fps);
+    if (c->test_frames < EXPOSURE_MIN_TEST_FRAMES) {
+        c->test_frames = EXPOSURE_MIN_TEST_FRAMES;
+    }
+    c->threshold = threshold;
+    if (setup_threshold_tracker(&c->tracker, c->test_frames, 0.5) < 0) {
+        return -1;
+    }
+    fprintf(stderr, "Searching '%.32s' from %d to %d\n", c->exposure.name,
+            c->exposure.minimum, c->initial_exposure);
+    // The current exposure is tried first; if it does not work, no
+    // shorter one will
+    c->passed = -1;
+    c->failed = -1;
+    c->searching = true;
+    try_exposure(c, c->initial_exposure);
+    return 0;
+}
+
+void cleanup_v4l_controls(struct v4l_controls *c) {
+    // In reverse, so the exposure is set while it is still manual
+    for (int i = c->nsaved - 1; i >= 0; i--) {
+        if (ioctl_loop(c->fd, VIDIOC_S_CTRL, &c->saved[i]) < 0) {
+            fprintf(stderr, "Failed to restore control %#x to %d: %s\n",
+                    c->saved[i].id, c->saved[i].value, strerror(errno));
+        }
+    }
+    c->nsaved = 0;
+    cleanup_threshold_tracker(&c->tracker);
+}
+
+static bool separated(const struct v4l_controls *c) {
+    const struct threshold_tracker *t = &c->tracker;
+    if (!t->confident ||
+        t->high_mean - t->low_mean < EXPOSURE_MIN_CONTRAST) {
+        return false;
+    }
+    return c->threshold <= 0. ||
+           (t->low_mean < c->threshold && c->threshold < t->high_mean);
+}
+
+/* The exposure to try after c->trying, or -1 if the search is over */
+static int32_t next_exposure(const struct v4l_controls *c) {
+    if (c->passed < 0) {
+        return -1;
+    }
+    if (c->failed < 0) {
+        // Often the display is bright enough for any exposure
+        return c->passed > c->exposure.minimum ? c->exposure.minimum : -1;
+    }
+    if (c->passed <= c->failed * EXPOSURE_RESOLUTION) {
+        return -1;
+    }
+    // Bisect on a log scale; exposures range over orders of magnitude
+    double lo = c->failed > 1 ? c->failed : 1;
+    int32_t next = round_exposure(c, sqrt(lo * c->passed));
+    if (next <= c->failed) {
+        next = round_exposure(c, c->failed + (c->exposure.step > 0
+                                                  ? c->exposure.step
+                                                  : 1));
+    }
+    return next < c->passed && next > c->failed ? next : -1;
+}
+
+bool exposure_search_add(struct v4l_controls *c, double level) {
+    if (!c->searching || ++c->nframes <= c->settle_frames) {
+        return false;
+    }
+    threshold_tracker_add(&c->tracker, level);
+    bool pass = separated(c);
+    if (!pass && c->nframes < c->settle_frames + c->test_frames) {
+        return false;
+    }
+    fprintf(stderr,
+            "Exposure %6d: %s; levels %.3f/%.3f, separation %.2f\n",
+            c->trying, pass ? "separates" : "too short", c->tracker.low_mean,
+            c->tracker.high_mean, c->tracker.separation);
+    if (pass) {
+        c->passed = c->trying;
+    } else {
+        c->failed = c->trying;
+    }
+
+    int32_t next = next_exposure(c);
+    if (next >= 0) {
+        try_exposure(c, next);
+        return false;
+    }
+    c->searching = false;
+    if (c->passed < 0) {
+        fprintf(stderr,
+                "Light and dark frames are not clearly separated; keeping "
+                "exposure %d\n",
+                c->initial_exposure);
+        return true;
+    }
+    if (c->trying != c->passed) {
+        set_control(c->fd, &c->exposure, c->passed);
+    }
+    fprintf(stderr, "Chosen exposure: %d, was %d\n", c->passed,
+            c->initial_exposure);
+    return true;
+}
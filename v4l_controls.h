@@ -0,0 +1,65 @@
+#pragma once
+
+#include "threshold.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <linux/videodev2.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Camera controls, through VIDIOC_QUERYCTRL and VIDIOC_S_CTRL. Automatic
+ * exposure, gain and white balance are turned off, since they would chase
+ * the flickering display. The exposure can also be searched for: the
+ * shorter it is, the sooner a frame shows the display's change, but too
+ * short an exposure leaves light and dark frames hard to tell apart.
+ * Every control changed is restored at cleanup, so other programs get the
+ * camera back as it was. */
+
+// Automatic exposure, its frame rate priority, gain, white balance, and
+// the exposure itself
+#define MAX_SAVED_CONTROLS 5
+
+struct v4l_controls {
+    int fd;
+    // Values from before the first change, in the order they were changed
+    struct v4l2_control saved[MAX_SAVED_CONTROLS];
+    int nsaved;
+    // The exposure time control, if the camera has a manual one
+    bool have_exposure;
+    struct v4l2_queryctrl exposure;
+    int32_t initial_exposure;
+
+    // While searching, each exposure is tried until the levels of its
+    // frames split clearly into light and dark ones, or for test_frames
+    bool searching;
+    int32_t trying;
+    int32_t passed, failed; // the shortest success, longest failure, or -1
+    int settle_frames, test_frames, nframes;
+    double threshold; // must lie between light and dark levels, if > 0
+    struct threshold_tracker tracker;
+};
+
+/* Apply LATENCYTOOL_EXPOSURE to the camera open at `fd`: print its
+ * controls, turn the automatic ones off, and set the exposure or prepare to
+ * search for one. `queued` is the number of frames that may have been
+ * captured before a control change is made, and `threshold` the fixed
+ * light/dark threshold, or 0 if it is calibrated. Returns -1 on failure. */
+int setup_v4l_controls(struct v4l_controls *c, int fd, double fps,
+                       int queued, double threshold);
+/* Restore the saved controls; `fd` must still be open */
+void cleanup_v4l_controls(struct v4l_controls *c);
+/* While c->searching, add each frame's level; the display should flicker.
+ * Returns true once the search is over, and the shortest exposure found
+ * to separate light and dark frames has been set. */
+bool exposure_search_add(struct v4l_controls *c, double level);
+
+/* ioctl, retried when interrupted by a signal */
+int ioctl_loop(int fd, unsigned long int req, void *arg);
+
+#ifdef __cplusplus
+}
+#endif
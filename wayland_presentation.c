@@ -0,0 +1,114 @@
+#include "wayland_presentation.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// One per commit, until the compositor reports on it
+struct feedback {
+    struct presentation *p;
+    struct wp_presentation_feedback *fb;
+    struct wl_list link; // in presentation::pending
+    bool to_dark;
+};
+
+static void free_feedback(struct feedback *f) {
+    wl_list_remove(&f->link);
+    wp_presentation_feedback_destroy(f->fb);
+    free(f);
+}
+
+static void clock_id(void *data, struct wp_presentation *wp, uint32_t clk_id) {
+    struct presentation *p = (struct presentation *)data;
+    p->monotonic = clk_id == CLOCK_MONOTONIC;
+    if (!p->monotonic) {
+        fprintf(stderr, "Compositor presentation clock %u is not "
+                        "CLOCK_MONOTONIC; ignoring presentation times\n",
+                clk_id);
+    }
+}
+
+static const struct wp_presentation_listener presentation_listener = {
+    .clock_id = clock_id,
+};
+
+static void sync_output(void *data, struct wp_presentation_feedback *fb,
+                        struct wl_output *output) {}
+
+static void presented(void *data, struct wp_presentation_feedback *fb,
+                      uint32_t tv_sec_hi, uint32_t tv_sec_lo,
+                      uint32_t tv_nsec, uint32_t refresh, uint32_t seq_hi,
+                      uint32_t seq_lo, uint32_t flags) {
+    struct feedback *f = (struct feedback *)data;
+    struct present_info info;
+    memset(&info, 0, sizeof(info));
+    info.time.tv_sec = (time_t)(((uint64_t)tv_sec_hi << 32) | tv_sec_lo);
+    info.time.tv_nsec = tv_nsec;
+    info.to_dark = f->to_dark;
+    info.refresh_ns = refresh;
+    info.msc = ((uint64_t)seq_hi << 32) | seq_lo;
+    if (flags & WP_PRESENTATION_FEEDBACK_KIND_VSYNC) {
+        info.flags |= PRESENT_VSYNC;
+    }
+    if (flags & WP_PRESENTATION_FEEDBACK_KIND_HW_CLOCK) {
+        info.flags |= PRESENT_HW_CLOCK;
+    }
+    if (flags & WP_PRESENTATION_FEEDBACK_KIND_HW_COMPLETION) {
+        info.flags |= PRESENT_HW_COMPLETION;
+    }
+    if (flags & WP_PRESENTATION_FEEDBACK_KIND_ZERO_COPY) {
+        info.flags |= PRESENT_ZERO_COPY;
+    }
+    if (f->p->monotonic) {
+        backend_note_presentation(f->p->backend, &info);
+    }
+    free_feedback(f);
+}
+
+static void discarded(void *data, struct wp_presentation_feedback *fb) {
+    // A later commit replaced this one before it was shown
+    free_feedback((struct feedback *)data);
+}
+
+static const struct wp_presentation_feedback_listener feedback_listener = {
+    .sync_output = sync_output,
+    .presented = presented,
+    .discarded = discarded,
+};
+
+void presentation_bind(struct presentation *p, struct wl_registry *registry,
+                       uint32_t name) {
+    p->wp = wl_registry_bind(registry, name, &wp_presentation_interface, 1);
+    wl_list_init(&p->pending);
+    if (p->wp) {
+        wp_presentation_add_listener(p->wp, &presentation_listener, p);
+    }
+}
+
+void presentation_request(struct presentation *p, struct wl_surface *surface,
+                          bool to_dark) {
+    if (!p->wp || !p->backend) {
+        return;
+    }
+    struct feedback *f = (struct feedback *)malloc(sizeof(struct feedback));
+    if (!f) {
+        return;
+    }
+    f->p = p;
+    f->to_dark = to_dark;
+    f->fb = wp_presentation_feedback(p->wp, surface);
+    wl_list_insert(&p->pending, &f->link);
+    wp_presentation_feedback_add_listener(f->fb, &feedback_listener, f);
+}
+
+void presentation_cleanup(struct presentation *p) {
+    if (!p->wp) {
+        return;
+    }
+    struct feedback *f, *next;
+    wl_list_for_each_safe(f, next, &p->pending, link) {
+        free_feedback(f);
+    }
+    wp_presentation_destroy(p->wp);
+    p->wp = NULL;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "interface.h"
+
+#include "obj/presentation-time-stable-client-protocol.h"
+#include <wayland-client.h>
+
+/* Presentation feedback for the Wayland frontends. Each commit that
+ * switches colors asks wp_presentation when it reached the screen, and the
+ * answer is passed on to the backend, so that the analysis can tell the
+ * delay up to scanout from the delay from scanout to the camera. */
+
+struct presentation {
+    struct wp_presentation *wp; // NULL if the compositor lacks it
+    bool monotonic; // the compositor's clock, which must match the camera's
+    void *backend;
+    struct wl_list pending; // feedback not yet reported on, once bound
+};
+
+/* Call from the registry listener, for the "wp_presentation" global */
+void presentation_bind(struct presentation *p, struct wl_registry *registry,
+                       uint32_t name);
+/* Call before the commit that shows the new color */
+void presentation_request(struct presentation *p, struct wl_surface *surface,
+                          bool to_dark);
+/* Call before disconnecting, to release wp_presentation and any feedback
+ * still pending */
+void presentation_cleanup(struct presentation *p);